@@ -4,15 +4,113 @@
 //
 // Compile with:
 //
-// mpicc -Wall -o heatEqn heatEqn.c
+// mpicc -Wall -O3 -march=native -fopenmp -o heatEqn heatEqn.c -lm
 //
 // and launch with a square number of processes, i.e. 4, 9, ...
 //
 // mpiexec -n 4 ./heatEqn
 //
+// The stencil is also parallelised with OpenMP within each process, so fewer processes (say one or two
+// per socket) can be used, with OMP_NUM_THREADS set to the number of cores each one should use.
+//
+// The problem size, number of iterations, tolerance and ghost-cell exchange backend (see heatEqn_halo.h)
+// can be given on the command line, e.g.
+//
+// mpiexec -n 4 ./heatEqn -L 32768 -iterations 1000 -tolerance 1e-4 -halo neighbour
+//
+// With a tolerance, the iterations stop once the largest change to any cell in an iteration (i.e. the
+// max-norm of the Jacobi residual, up to a factor of 4) falls below it. This is tested every few
+// iterations (-checkInterval), with the global reduction overlapped with the following iteration.
+//
+// With -ghost <k>, each local grid has k layers of ghost cells, which are only exchanged every k iterations.
+// In between, each process also updates the ghost cells that will still be needed, i.e. redundantly
+// repeats some of its neighbours' work, so the results are unchanged. This trades fewer (but larger)
+// messages against extra computation, which pays off when latency dominates, e.g. for small local grids.
+//
+// With -tile <size>, the iterations between exchanges are instead performed one size*size tile at a time,
+// i.e. all of them for one tile before moving on to the next, so each tile is read from and written to
+// main memory once per exchange rather than once per iteration. Each tile is copied into a small scratch
+// array along with the surrounding cells it depends on (whose updates are repeated by every tile that
+// needs them), so tiles are independent. Use e.g. -ghost 4 -tile 64, so that the scratch arrays fit in cache.
+//
+// With -tasks <size>, the Jacobi solver instead splits each local grid into size*size sub-blocks, and updates
+// each one as an OpenMP task that depends only on the sub-blocks around it (from the previous iteration), and
+// for those on the edge, on the ghost-cell exchange, which is also a task. Nothing then waits for the whole
+// grid between iterations: the sub-blocks whose inputs are ready run while the ghost cells are still in
+// flight, and a slow sub-block or neighbour only holds up what actually depends on it. The tasks for every
+// iteration up to the next convergence test (-checkInterval) are created at once, and the exchanges made from
+// whichever thread runs them, which needs MPI_THREAD_SERIALIZED. With a tolerance, this may perform up to
+// -checkInterval more iterations than without. This does not support -ghost, -tile or -rebalance.
+//
+// With -solver sor, the grid is instead updated in place by red-black Gauss-Seidel with successive
+// over-relaxation: the cells are coloured like a chessboard, and each iteration updates all the red cells
+// (which only depend on black cells), then all the black cells. Each colour's edge cells are exchanged
+// just after they are updated, i.e. half the ghost cells at a time. The relaxation factor -omega defaults
+// to the optimum for this problem, 2/(1+sin(pi/(L+1))), for which the number of iterations to converge
+// grows as L rather than L^2. With -omega 1 this is plain Gauss-Seidel. This does not support -ghost or -tile.
+//
+// With -solver multigrid, each iteration is instead a geometric multigrid V-cycle (see heatEqn_multigrid.h),
+// which reduces the error by a roughly constant factor independent of L, so the number of iterations to
+// converge does not grow with the grid size at all. This also does not support -ghost or -tile.
+//
+// With -solver cg, each iteration is instead one step of the (matrix-free) preconditioned conjugate gradient
+// method (see heatEqn_cg.h), which like SOR needs a number of iterations proportional to L, but without a
+// relaxation factor to tune. The preconditioner is chosen with -preconditioner. The two global sums in each
+// iteration synchronise all the processes; -solver pipelined-cg instead combines them into a non-blocking
+// reduction that overlaps with the stencil. Neither supports -ghost or -tile.
+//
+// With -solver explicit, each iteration is instead a forward Euler time step of the transient heat equation
+// du/dt = div(D grad u) + q (see heatEqn_diffusion.h), with the time step -dt and grid spacing -dx. The
+// diffusivity D is -diffusivity times a field (-coefficients) that is -contrast times larger in places, and
+// q is a heater of strength -source in the middle of the domain. The time step defaults to the largest that
+// is stable, dx^2/(4 max D), at which a uniform D gives the Jacobi iteration; larger ones are refused. This
+// supports -ghost and -tasks, but not -tile or -rebalance.
+//
+// With -solver adi, each iteration is instead an implicit time step of the same equation, by the alternating
+// direction implicit method (see heatEqn_adi.h): two half steps, each solving a tridiagonal system along every
+// row or every column of the global grid, split between the processes that own it. This is stable for any
+// time step, so -dt may be many times the explicit limit (which is still the default). It does not support
+// -ghost, -tile, -tasks or -rebalance.
+//
+// With -solver gray-scott, the grid instead holds two coupled fields, the species u and v of the Gray-Scott
+// reaction-diffusion model (see heatEqn_reaction.h), with diffusivities -du and -dv, feed rate -feed and kill
+// rate -kill, stepped explicitly with -dt and -dx (which default to 1, in which units the default parameters
+// grow spots). The fields are interleaved, so the ghost cells of both travel in one message per direction.
+// Snapshots and the display show v. This supports -ghost and -tasks, but not -tile, -rebalance, -checkpoint
+// or -restart.
+//
+// With -checkpoint <file>, the grid is saved to a single file with MPI-IO every -checkpointInterval iterations
+// and at the end (see heatEqn_checkpoint.h), and -restart <file> continues from such a file, which may have
+// been written by a different number of processes (the number of iterations includes those before the
+// restart). With -checkpointMode nonblocking, each checkpoint is written in the background while the
+// iterations continue.
+//
+// With -snapshot <prefix>, the grid is gathered onto rank 0 every -snapshotInterval iterations and at the
+// end, and written as an image or a raw binary file (see heatEqn_snapshot.h), in the -snapshotFormat.
+// With -ioRanks <k>, the last k processes do not compute but write the snapshots instead, while the others
+// carry on iterating; the number of the others must then be a square number, and k at most the number of
+// processes per side.
+//
+// With -rebalance <M>, the Jacobi solver measures how long each process spends computing, and every M
+// iterations moves the boundaries between the blocks so that faster processes get more of the grid (see
+// heatEqn_rebalance.h). The blocks go back to being equal before the grid is displayed or saved at the end,
+// so this cannot be combined with -checkpointInterval or -snapshotInterval, and M must be a multiple of -ghost.
+//
+// With -profile <file>, the time each process spends in each phase of the iterations (starting and waiting
+// for the halo exchange, updating the interior and the edges, the convergence test, and I/O) is written to
+// the file as JSON or CSV (-profileFormat), along with the minimum, maximum and mean across processes (see
+// heatEqn_profile.h). With -trace <prefix>, each process also writes the times of every iteration to
+// <prefix>_<rank>.csv.
+//
+// With -ensemble <file>, many independent simulations are run at once, one for each line of the file, which
+// gives the options for that simulation in addition to those on the command line (see heatEqn_ensemble.h).
+// Rank 0 hands the simulations out to groups of -groupSize processes as they finish their previous ones, and
+// prints a table of the results at the end. The number of processes must then be one more than a multiple of
+// the group size, and each group must satisfy the conditions below (and any -ioRanks).
+//
 // In addition to being a square number, the number of domains in both directions
 // must divide the global grid size L. Therefore running on 9 processes won't work
-// unless you also change L to (say) 18 (L is a #define near the start of this file).
+// unless you also change L to (say) 18.
 //
 
 //
@@ -20,22 +118,166 @@
 //
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Ghost-cell exchange backends, and the multigrid and conjugate gradient solvers built on them, explicit and implicit
+// time stepping, and reaction-diffusion.
+#include "heatEqn_halo.h"
+#include "heatEqn_multigrid.h"
+#include "heatEqn_cg.h"
+#include "heatEqn_diffusion.h"
+#include "heatEqn_adi.h"
+#include "heatEqn_reaction.h"
+
+// Checkpointing with MPI-IO, and gathering the grid for display and snapshots.
+#include "heatEqn_checkpoint.h"
+#include "heatEqn_snapshot.h"
+
+// Timing the phases of the iterations, and balancing the load between processes.
+#include "heatEqn_profile.h"
+#include "heatEqn_rebalance.h"
+
+// Running many simulations in one job.
+#include "heatEqn_ensemble.h"
 
 //
 // Parameters and global variables.
 //
-#define L 8
-#define NUM_ITERATIONS 10
+#define MAX_DISPLAY_L 32 // Larger grids are not displayed.
 
-int local_L; // The dimensions of the local grids. Convenient to make it global.
+// The options, all of which can be set on the command line. parseCommandLine() first sets them to their defaults.
+int L;					// The global grid size, excluding the boundary.
+int numIterations;		// The (maximum) number of iterations.
+float tolerance;		// Stop once no cell changes by more than this in one iteration. Zero to always iterate numIterations times.
+int checkInterval;		// How often (in iterations) to test for convergence.
+int ghostWidth;			// The number of layers of ghost cells, i.e. the number of iterations between exchanges.
+int tileSize;			// The size of the tiles for temporal tiling, or zero to update the whole grid each iteration.
+int taskSize;			// The size of the sub-blocks updated as OpenMP tasks, or zero to update the whole grid in parallel loops.
+float omega;			// The relaxation factor for SOR, or zero for the optimum.
+const char *checkpointName;		// The file to save checkpoints to, if any.
+int checkpointInterval;			// How often (in iterations) to save a checkpoint, or zero for only at the end.
+int checkpointNonblocking;		// Non-zero to write checkpoints in the background.
+const char *restartName;		// The checkpoint file to restart from, if any.
+const char *snapshotPrefix;		// The start of the names of the snapshot files, if writing snapshots.
+int snapshotInterval;			// How often (in iterations) to write a snapshot, or zero for only at the end.
+SnapshotFormat snapshotFormat;	// The format of the snapshot files.
+int numIORanks;					// The number of processes dedicated to writing snapshots.
+const char *profileName;		// The file to write the profile summary to, if profiling.
+ProfileFormat profileFormat;	// The format of the profile summary.
+const char *tracePrefix;		// The start of the names of the per-iteration trace files, if tracing.
+int rebalanceInterval;			// How often (in iterations) to balance the load, or zero for never.
+double diffusivity;				// The diffusivity D for -solver explicit or adi, before any contrast.
+double timeStep;				// The time step for -solver explicit or adi, or zero for the largest that is stable explicitly.
+double gridSpacing;				// The distance between cells for -solver explicit or adi, or zero for 1/(L+1).
+DiffusionField diffusionField;	// Where D is larger, by a factor of diffusionContrast.
+double diffusionContrast;		// How much larger.
+double heatSource;				// The rate at which the heater in the middle heats, for -solver explicit or adi.
+double speciesDiffusivity[2];	// The diffusivities of u and v, for -solver gray-scott.
+double feedRate, killRate;		// The rates at which u is fed in and v removed, likewise.
+const char *ensembleName;		// The file listing the members of an ensemble, if running one.
+int groupSize;					// The number of processes running each member of an ensemble.
+
+// The available solvers.
+typedef enum
+{
+	SOLVER_JACOBI,		 // Jacobi iteration, reading from one grid and writing to another.
+	SOLVER_SOR,			 // Red-black Gauss-Seidel with successive over-relaxation, in place.
+	SOLVER_MULTIGRID,	 // Multigrid V-cycles, in place.
+	SOLVER_CG,			 // Preconditioned conjugate gradients, in place.
+	SOLVER_PIPELINED_CG, // The same, overlapping the global sums with the stencil.
+	SOLVER_EXPLICIT,	 // Forward Euler time steps, reading from one grid and writing to another as for Jacobi.
+	SOLVER_ADI,			 // Alternating direction implicit time steps, in place via the other grid.
+	SOLVER_GRAY_SCOTT,	 // Explicit time steps of two coupled fields, reading from one grid and writing to another.
+	NUM_SOLVERS
+} Solver;
+
+const char *solverNames[NUM_SOLVERS] = {"jacobi", "sor", "multigrid", "cg", "pipelined-cg", "explicit", "adi", "gray-scott"};
+Solver solver;
+CGPreconditioner preconditioner; // The preconditioner for the conjugate gradient solvers.
+
+int local_L;		// The dimensions of the local grids. Convenient to make it global.
+int localRows, localCols; // The Jacobi solver's local grid, which with -rebalance is not local_L square.
+size_t rowStride; // The distance between rows in the local grids, including the ghost cells and padding.
+Diffusion diffusion; // The coefficients and sources for -solver explicit or adi.
+Reaction reaction; // The coefficients for -solver gray-scott.
 
 //
 // Function prototypes; definitions after main().
 //
-int _index(int row, int col);					   // Returns the grid index for the given global row and column.
+int parseCommandLine(int argc, char **argv, int rank, HaloBackend *backend); // Parses the options; returns -1 if invalid.
+int simulate(MPI_Comm comm, HaloBackend backend, int provided, double *results); // Runs one simulation; returns -1 if it cannot.
+int ensemble(int argc, char **argv, int provided); // Runs the simulations of an ensemble; returns -1 if it cannot.
 void initialiseGrid(float *grid, int rank, int p); // Fills the initial grid.
-void displayGrid(float *grid, int rank, int p);	   // Displays the current grid.
+void displayGrid(Snapshot *snapshot, float *grid, int rank, int p); // Displays the current grid.
+float tiledUpdate(const float *oldGrid, float *newGrid, int steps, const int *extent, int edgeTiles); // Several iterations tile by tile.
+float taskUpdate(HaloExchange *halo, int current, int steps); // Several iterations as a graph of tasks.
+float sorIteration(float *grid, HaloExchange *colourHalo); // One iteration of red-black SOR.
+float *outputGrid(float *grid, float *view); // The grid to display or write.
+void repartition(Rebalance *rb, HaloExchange *halo, int current, HaloBackend backend, const int *rowStarts, const int *colStarts); // Moves to new block sizes.
+
+// Have used 1D arrays (rather than 2D), so perform the indexing 'by hand.' Local grids can have more
+// than 2^31 cells, so the index is a size_t. Rows and columns 1 to local_L (or localRows and localCols) are
+// the local grid, with the ghost cells either side, i.e. from 1-ghostWidth to local_L+ghostWidth. Defined here so it can be inlined.
+static inline size_t _index(int row, int col) { return (size_t)(row + ghostWidth - 1) * rowStride + (col + ghostWidth - 1); }
+
+// The 5-point stencil along part of one row, the innermost loop of the solver: updates n cells from dest[0],
+// reading the same cells of the old grid from src[0], and returns the largest change to any of them. The
+// grids never overlap, and 0.25f (rather than 0.25) avoids converting to double, so the loop vectorises.
+// The maximum is taken with a comparison, as fmaxf()'s handling of NaNs stops the reduction vectorising.
+static inline float stencilRow(float *restrict dest, const float *restrict src, size_t stride, int n)
+{
+	int i;
+	float change = 0.0f;
+#pragma omp simd reduction(max : change)
+	for (i = 0; i < n; i++)
+	{
+		dest[i] = 0.25f * (src[i + stride] + src[i - stride] + src[i + 1] + src[i - 1]);
+		float diff = fabsf(dest[i] - src[i]);
+		change = (diff > change ? diff : change);
+	}
+	return change;
+}
+
+// Updates n cells of a row from (row,col) onwards, reading from oldGrid and writing to newGrid, by the Jacobi
+// stencil or, for -solver explicit or gray-scott, a forward Euler step. Returns the largest change to any of them.
+// The Gray-Scott grids have both fields of each cell, so its cells are REACTION_FIELDS floats apart.
+static inline float updateRow(float *newGrid, const float *oldGrid, int row, int col, int n)
+{
+	if (solver == SOLVER_GRAY_SCOTT)
+	{
+		size_t i = (size_t)(row + ghostWidth - 1) * rowStride + REACTION_FIELDS * (col + ghostWidth - 1);
+		return reactionRow(&newGrid[i], &oldGrid[i], &reaction, rowStride, n);
+	}
+
+	size_t i = _index(row, col);
+	if (solver == SOLVER_EXPLICIT)
+		return diffusionRow(&newGrid[i], &oldGrid[i], &diffusion.coef[i], &diffusion.source[i], rowStride, n);
+	return stencilRow(&newGrid[i], &oldGrid[i], rowStride, n);
+}
+
+// Red-black SOR along part of one row: updates the cells with (row+col)%2 == parity in columns [c0,c1) in
+// place, and returns the largest change to any of them. These only read cells of the other colour, so the
+// iterations are independent even though the grid is updated in place.
+static inline float sorRow(float *grid, int row, int c0, int c1, int parity)
+{
+	int i, first = c0 + ((row + c0 + parity) & 1), n = (c1 - first + 1) / 2;
+	float *g = &grid[_index(row, first)], change = 0.0f;
+	size_t stride = rowStride;
+#pragma omp simd reduction(max : change)
+	for (i = 0; i < 2 * n; i += 2)
+	{
+		float old = g[i];
+		g[i] = (1.0f - omega) * old + omega * 0.25f * (g[i + stride] + g[i - stride] + g[i + 1] + g[i - 1]);
+		float diff = fabsf(g[i] - old);
+		change = (diff > change ? diff : change);
+	}
+	return change;
+}
 
 //
 // Main.
@@ -46,275 +288,1303 @@ int main(int argc, char **argv)
 	// Initialisation.
 	//
 
-	// Initialise MPI and get the rank and total number of processes.
-	int rank, numProcs;
-	MPI_Init(&argc, &argv);
+	// Initialise MPI and get the rank and total number of processes. Only the master thread makes
+	// MPI calls, outside of the OpenMP parallel regions, so MPI_THREAD_FUNNELED is sufficient, except
+	// with -tasks, where the exchange tasks may run on any thread (though never two at once).
+	int rank, numProcs, provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
 	MPI_Comm_size(MPI_COMM_WORLD, &numProcs);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-	// Check first that the number of processes is a square number (p*p).
-	int p = 1;
-	while (p * p < numProcs)
-		p++;
-	if (p * p != numProcs)
+	// Check the MPI library can be used alongside OpenMP threads.
+	if (provided < MPI_THREAD_FUNNELED)
 	{
 		if (rank == 0)
-			printf("Must execute using a square number of processes (4,9,...).\n");
+			printf("The MPI library does not support MPI_THREAD_FUNNELED.\n");
 		MPI_Finalize();
 		return EXIT_FAILURE;
 	}
 
+	// Parse the command line options.
+	HaloBackend backend;
+	if (parseCommandLine(argc, argv, rank, &backend) == -1)
+	{
+		MPI_Finalize();
+		return EXIT_FAILURE;
+	}
+
+	// Run the simulation on every process, or many of them, on groups of processes.
+	int status = (ensembleName ? ensemble(argc, argv, provided) : simulate(MPI_COMM_WORLD, backend, provided, NULL));
+	MPI_Finalize();
+	return (status == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+//
+// Runs one simulation on the processes of comm, with the options in the global variables. With 'results',
+// displays nothing, but fills in the ENSEMBLE_NUM_RESULTS results (see heatEqn_ensemble.h) on rank 0 of comm.
+// Returns -1 (on every process, after rank 0 has said why) if the options cannot be used on these processes.
+//
+int simulate(MPI_Comm comm, HaloBackend backend, int provided, double *results)
+{
+	int rank, numProcs;
+	MPI_Comm_size(comm, &numProcs);
+	MPI_Comm_rank(comm, &rank);
+
+	// The exchange timers count from the start of each simulation.
+	haloPostTime = haloWaitTime = 0.0;
+	haloExchanges = 0;
+
+	// Check first that the number of processes computing the grid, i.e. excluding any I/O ranks, is a square number (p*p).
+	int p = 1, numCompute = numProcs - numIORanks;
+	while (p * p < numCompute)
+		p++;
+	if (numCompute < 1 || p * p != numCompute)
+	{
+		if (rank == 0)
+			printf("Must execute using a square number of processes (4,9,...), plus any I/O ranks.\n");
+		return -1;
+	}
+
+	// Each I/O rank writes whole rows of blocks.
+	if (numIORanks > p)
+	{
+		if (rank == 0)
+			printf("The number of I/O ranks %d cannot exceed the number of processes per side %d.\n", numIORanks, p);
+		return -1;
+	}
+
 	// Now check that the domains are commensurate with the number of processes per side.
 	if (L % p)
 	{
 		if (rank == 0)
 			printf("Grid dimension %d needs to be a multiple of the number of processes per side %d.\n", L, p);
-		MPI_Finalize();
-		return EXIT_FAILURE;
+		return -1;
 	}
 
-	// Initialise the local grids for each process (not there is no 'global grid' here).
-	local_L = L / p;
-	float *grid = (float *)malloc((local_L + 2) * (local_L + 2) * sizeof(float)); // local_L+2 so we also include the ghost cells.
+	// The red-black ordering relies on every update reading the latest values, so is not compatible with
+	// updating ghost cells redundantly or several iterations at a time. The tiles only apply the Jacobi stencil.
+	int stepped = (solver == SOLVER_JACOBI || solver == SOLVER_EXPLICIT || solver == SOLVER_GRAY_SCOTT);
+	if ((!stepped && ghostWidth > 1) || (solver != SOLVER_JACOBI && tileSize > 0))
+	{
+		if (rank == 0)
+			printf("Only the Jacobi, explicit and Gray-Scott solvers support -ghost, and only the Jacobi solver -tile.\n");
+		return -1;
+	}
+	if (taskSize > 0 && (!stepped || ghostWidth > 1 || tileSize > 0 || rebalanceInterval > 0 || provided < MPI_THREAD_SERIALIZED))
+	{
+		if (rank == 0)
+			printf("-tasks needs the Jacobi, explicit or Gray-Scott solver without -ghost, -tile or -rebalance, and an MPI library supporting MPI_THREAD_SERIALIZED.\n");
+		return -1;
+	}
+	if (solver == SOLVER_SOR && omega == 0.0f)
+		omega = 2.0 / (1.0 + sin(M_PI / (L + 1)));
 
-	// Fill in the original grid.
-	initialiseGrid(grid, rank, p);
+	// Forward Euler is only stable for small enough time steps (the CFL condition); default to the largest.
+	// ADI is stable for any time step, but defaults to the same one.
+	if (solver == SOLVER_EXPLICIT || solver == SOLVER_ADI)
+	{
+		if (gridSpacing == 0.0)
+			gridSpacing = 1.0 / (L + 1);
+		double limit = diffusionLimit(diffusionField, diffusivity, diffusionContrast, gridSpacing);
+		if (timeStep == 0.0)
+			timeStep = limit;
+		if (solver == SOLVER_EXPLICIT && timeStep > limit)
+		{
+			if (rank == 0)
+				printf("The time step %g exceeds the largest stable time step dx^2/(4 max D) = %g.\n", timeStep, limit);
+			return -1;
+		}
+	}
 
-	// Display the initial grid.
-	if (rank == 0)
-		printf("Initial grid:\n");
-	displayGrid(grid, rank, p);
+	// Likewise for the Gray-Scott model, in units of the grid spacing and the time step by default. A checkpoint
+	// only holds one field, so could not restart it.
+	if (solver == SOLVER_GRAY_SCOTT)
+	{
+		if (gridSpacing == 0.0)
+			gridSpacing = 1.0;
+		if (timeStep == 0.0)
+			timeStep = 1.0;
+		double fastest = (speciesDiffusivity[0] > speciesDiffusivity[1] ? speciesDiffusivity[0] : speciesDiffusivity[1]);
+		if (timeStep > gridSpacing * gridSpacing / (4.0 * fastest) || checkpointName || restartName)
+		{
+			if (rank == 0)
+				printf("The Gray-Scott solver needs a time step of at most dx^2/(4 max D) = %g, and does not support -checkpoint or -restart.\n", gridSpacing * gridSpacing / (4.0 * fastest));
+			return -1;
+		}
+	}
+
+	// Rebalancing moves the blocks' boundaries, which the other solvers and any output in between assume are fixed.
+	if (rebalanceInterval > 0 && (solver != SOLVER_JACOBI || rebalanceInterval % ghostWidth || checkpointInterval > 0 || snapshotInterval > 0 || L / p < 2))
+	{
+		if (rank == 0)
+			printf("-rebalance needs the Jacobi solver, blocks of at least 2x2 and an interval that is a multiple of -ghost, without -checkpointInterval or -snapshotInterval.\n");
+		return -1;
+	}
+
+	// The ghost cells are filled from the neighbours' grids, so cannot be deeper than those grids.
+	if (ghostWidth > L / p)
+	{
+		if (rank == 0)
+			printf("The number of ghost layers %d cannot exceed the local grid size %d.\n", ghostWidth, L / p);
+		return -1;
+	}
+
+	// Separate the I/O ranks, which are the last ranks, from the others, and give them a communicator of their
+	// own (so their messages cannot be confused with any others). They write snapshots until told to stop.
+	MPI_Comm computeComm, ioComm, snapshotComm;
+	int isIORank = (rank >= numCompute);
+	if (numIORanks > 0)
+	{
+		MPI_Comm_dup(comm, &snapshotComm);
+		MPI_Comm_split(comm, isIORank, rank, isIORank ? &ioComm : &computeComm);
+		if (isIORank)
+		{
+			snapshotServe(snapshotComm, ioComm, p, L / p, snapshotPrefix, snapshotFormat);
+			MPI_Comm_free(&ioComm);
+			MPI_Comm_free(&snapshotComm);
+			return 0;
+		}
+	}
+	else
+		computeComm = comm;
+
+	// Arrange the blocks in a p*p Cartesian grid, so that the neighbouring blocks (or MPI_PROC_NULL at the
+	// domain boundary) are known to MPI. Ranks are not reordered, so block (rowBlock,colBlock) is still owned
+	// by rank p*rowBlock+colBlock, as assumed by displayGrid().
+	MPI_Comm gridComm;
+	int dims[2] = {p, p}, periods[2] = {0, 0};
+	MPI_Cart_create(computeComm, 2, dims, periods, 0, &gridComm);
+
+	// Initialise the local grids for each process (not there is no 'global grid' here). The grids, which
+	// include the ghost cells, are allocated along with the ghost-cell exchange as some backends need
+	// them to live in memory that MPI has allocated. Two grids are needed for the Jacobi iteration, which
+	// reads from one and writes to the other, swapping them after each iteration. The others only need one.
+	local_L = localRows = localCols = L / p;
+	// The Gray-Scott grids hold both of its fields, interleaved, so that they are exchanged together.
+	int i, numGrids = (stepped || solver == SOLVER_ADI ? 2 : 1), numFields = (solver == SOLVER_GRAY_SCOTT ? REACTION_FIELDS : 1);
+	HaloExchange halo[2];
+	for (i = 0; i < numGrids; i++)
+		haloCreateFields(&halo[i], backend, gridComm, local_L, local_L, ghostWidth, numFields);
+	rowStride = halo[0].stride;
+	float *grid = halo[0].grid;
+
+	// Only one of its fields is displayed or written, which is copied out into a grid of its own, laid out as
+	// the others are (with the same stride, so the output need not know).
+	float *view = NULL;
+	if (solver == SOLVER_GRAY_SCOTT)
+	{
+		MPI_Aint bytes = (MPI_Aint)(local_L + 2 * ghostWidth) * rowStride * sizeof(float);
+		if (posix_memalign((void **)&view, HALO_ALIGNMENT, bytes))
+			haloAllocateFail(gridComm, bytes);
+		reactionCreate(&reaction, speciesDiffusivity[0], speciesDiffusivity[1], feedRate, killRate, timeStep, gridSpacing);
+	}
+
+	// SOR exchanges the red and the black cells separately. A cell (row,col) of the global grid is red if
+	// row+col is even; the offset of this block determines which local cells that is.
+	HaloExchange colourHalo[2];
+	if (solver == SOLVER_SOR)
+	{
+		int coords[2];
+		MPI_Cart_coords(gridComm, rank, 2, coords);
+		for (i = 0; i < 2; i++)
+			haloCreateColour(&colourHalo[i], &halo[0], (i + (coords[0] + coords[1]) * local_L) % 2);
+	}
+
+	// Explicit and implicit time stepping need the diffusivity and the source in every cell. ADI also solves along
+	// the rows and columns of blocks.
+	ADI adi;
+	if (solver == SOLVER_EXPLICIT || solver == SOLVER_ADI)
+		diffusionCreate(&diffusion, gridComm, local_L, local_L, ghostWidth, rowStride, L, gridSpacing, timeStep, diffusionField, diffusivity, diffusionContrast, heatSource);
+	if (solver == SOLVER_ADI)
+		adiCreate(&adi, gridComm, &diffusion, local_L, local_L, ghostWidth, rowStride);
+
+	// Multigrid builds a hierarchy of coarser grids below this one.
+	Multigrid mg;
+	if (solver == SOLVER_MULTIGRID)
+		mgCreate(&mg, &halo[0], backend, gridComm, p);
+
+	// Fill in the original grid. Both grids are filled, so both have the (zero) boundary conditions.
+	for (i = 0; i < numGrids; i++)
+		if (solver == SOLVER_GRAY_SCOTT)
+			reactionInitialise(halo[i].grid, gridComm, local_L, local_L, ghostWidth, rowStride, L);
+		else
+			initialiseGrid(halo[i].grid, rank, p);
+
+	// Continue from a checkpoint, if given. The iterations it performed count towards numIterations.
+	int firstIter = 0;
+	if (restartName && (firstIter = checkpointRead(restartName, gridComm, grid, local_L, local_L, ghostWidth, rowStride)) == -1)
+		MPI_Abort(gridComm, EXIT_FAILURE);
+
+	// Open the checkpoint file, if saving checkpoints.
+	Checkpoint checkpoint;
+	if (checkpointName)
+		checkpointCreate(&checkpoint, checkpointName, gridComm, local_L, local_L, ghostWidth, rowStride, checkpointNonblocking);
+
+	// Prepare to gather the grid onto rank 0, if it will be displayed or written. With I/O ranks, instead prepare
+	// to send the block to the I/O rank that writes its row of blocks.
+	Snapshot snapshot;
+	SnapshotClient snapshotClient;
+	int gathered = ((L <= MAX_DISPLAY_L && !results) || (snapshotPrefix && numIORanks == 0));
+	if (gathered)
+		snapshotCreate(&snapshot, gridComm, local_L, local_L, ghostWidth, rowStride);
+	if (numIORanks > 0)
+		snapshotClientCreate(&snapshotClient, snapshotComm, numCompute + (rank / p) * numIORanks / p, local_L, local_L);
+
+	// Conjugate gradients starts from the residual of the initial grid, so is set up once that is filled.
+	ConjugateGradient cg;
+	if (solver == SOLVER_CG || solver == SOLVER_PIPELINED_CG)
+		cgCreate(&cg, &halo[0], backend, gridComm, solver == SOLVER_PIPELINED_CG, preconditioner);
 
-	// For left and right boundaries, use a temporary array to extract single columns.
-	float *column = (float *)malloc(local_L * sizeof(float));
+	// Display the initial grid, except for an ensemble.
+	if (!results)
+	{
+		if (rank == 0)
+			printf("Initial grid:\n");
+		displayGrid(&snapshot, outputGrid(grid, view), rank, p);
+	}
+
+	// Measure the load, if balancing it. No block can be smaller than the ghost cells it fills in its neighbours,
+	// and the updates assume the interior and the edges do not overlap.
+	Rebalance rebalance;
+	int *rowStarts = NULL, *colStarts = NULL, numRebalances = 0;
+	if (rebalanceInterval > 0)
+	{
+		rebalanceCreate(&rebalance, gridComm, L, (ghostWidth > 2 ? ghostWidth : 2));
+		rowStarts = (int *)malloc(2 * (p + 1) * sizeof(int));
+		colStarts = rowStarts + p + 1;
+	}
 
 	// Start the timer.
+	Profile profile;
+	profileCreate(&profile, profileName != NULL, tracePrefix != NULL);
 	double startTime = MPI_Wtime();
+	profileStart(&profile);
 
 	//
 	// Iteration.
 	//
-	int iter, row, col;
-	for (iter = 0; iter < NUM_ITERATIONS; iter++)
+	int iter, row, dir, steps, current = 0, converged = 0;
+	float maxChange = 0.0f, reduceChange;
+	MPI_Request reduceRequest = MPI_REQUEST_NULL;
+	for (iter = firstIter; iter < numIterations && !converged; iter++)
 	{
-		// Get the row and column for 'this' rank in the partitioned domain.
-		int rowBlock = rank / p, colBlock = rank % p;
+		float localChange = 0.0f;
+		steps = 1;
 
-		//
-		// Synchronise the ghost cells.
-		//
-
-		// Upper boundary.
-		MPI_Request request_send_upper, request_recv_upper;
-		if (rowBlock > 0)
+		if (solver == SOLVER_SOR)
 		{
-			MPI_Isend(&grid[_index(1, 1)], local_L, MPI_FLOAT, rank - p, 0, MPI_COMM_WORLD, &request_send_upper);
+			// SOR updates the grid in place, so there is no swapping.
+			localChange = sorIteration(grid, colourHalo);
+			profileMark(&profile, PROFILE_INTERIOR);
 		}
-		if (rowBlock < p - 1)
+		else if (solver == SOLVER_MULTIGRID)
 		{
-			MPI_Irecv(&grid[_index(local_L + 1, 1)], local_L, MPI_FLOAT, rank + p, 0, MPI_COMM_WORLD, &request_recv_upper);
-		}
-
-		// Lower boundary.
-		MPI_Request request_send_lower, request_recv_lower;
-		if (rowBlock < p - 1)
-		{
-			MPI_Isend(&grid[_index(local_L, 1)], local_L, MPI_FLOAT, rank + p, 0, MPI_COMM_WORLD, &request_send_lower);
-		}
-		if (rowBlock > 0)
-		{
-			MPI_Irecv(&grid[_index(0, 1)], local_L, MPI_FLOAT, rank - p, 0, MPI_COMM_WORLD, &request_recv_lower);
+			// Also in place. The cycle does not need the largest change, which is the residual divided by 4
+			// (as the right hand side is zero), so only calculate it when testing for convergence.
+			mgCycle(&mg, 0);
+			if (tolerance > 0.0f)
+			{
+				mgExchange(&mg.levels[0]);
+				localChange = 0.25f * mgResidual(&mg.levels[0]);
+			}
+			profileMark(&profile, PROFILE_INTERIOR);
 		}
-
-		// Wait for completion of non-blocking operations.
-		if (rowBlock > 0)
+		else if (solver == SOLVER_CG || solver == SOLVER_PIPELINED_CG)
 		{
-			MPI_Wait(&request_send_upper, MPI_STATUS_IGNORE);
+			// Also in place. As for multigrid, the largest change of a Jacobi iteration is the residual divided by 4.
+			localChange = 0.25f * cgIteration(&cg);
+			profileMark(&profile, PROFILE_INTERIOR);
 		}
-		if (rowBlock < p - 1)
+		else if (solver == SOLVER_ADI)
 		{
-			MPI_Wait(&request_recv_upper, MPI_STATUS_IGNORE);
+			// Also in place, with the half step in the other grid.
+			localChange = adiStep(&adi, &halo[0], &halo[1]);
+			profileMark(&profile, PROFILE_INTERIOR);
 		}
-		if (rowBlock < p - 1)
+		else
 		{
-			MPI_Wait(&request_send_lower, MPI_STATUS_IGNORE);
+			// Read the current grid, and write to the other one (for Jacobi, or a time step). Normally this is one
+			// iteration, but with temporal tiling it is all of the iterations up to the next exchange (or the last iteration).
+			float *oldGrid = halo[current].grid, *newGrid = halo[1 - current].grid;
+			double computeStart = MPI_Wtime(), exchangeStart = haloPostTime + haloWaitTime;
+
+			// The ghost cells are exchanged every ghostWidth iterations. Each iteration after an exchange has one
+			// fewer layer of valid ghost cells to read, so updates one fewer layer of them; the last before the
+			// next exchange only updates the local grid itself. Ghost cells at the domain boundary are never updated.
+			int step = (iter - firstIter) % ghostWidth, extent[4];
+			for (dir = 0; dir < 4; dir++)
+				extent[dir] = (halo[current].neighbours[dir] != MPI_PROC_NULL ? ghostWidth - 1 - step : 0);
+
+			//
+			// Start synchronising the ghost cells. The sends only read the edge cells of the old grid, which
+			// are not modified, so the transfers can proceed while the interior is computed.
+			//
+			if (step == 0 && taskSize == 0)
+				haloStart(&halo[current]);
+
+			if (taskSize > 0)
+			{
+				// All the iterations up to the next convergence test at once, including their exchanges.
+				steps = checkInterval - iter % checkInterval;
+				steps = (numIterations - iter < steps ? numIterations - iter : steps);
+				localChange = taskUpdate(halo, current, steps);
+				current = (current + steps - 1) % 2;
+				profileMark(&profile, PROFILE_INTERIOR);
+			}
+			else if (tileSize > 0)
+			{
+				// The tiles that do not depend on the ghost cells can be updated while they are exchanged. Every
+				// call starts just after an exchange, so the ghost cells are valid to a depth of ghostWidth.
+				steps = (numIterations - iter < ghostWidth ? numIterations - iter : ghostWidth);
+				localChange = tiledUpdate(oldGrid, newGrid, steps, extent, 0);
+				profileMark(&profile, PROFILE_INTERIOR);
+				haloFinish(&halo[current]);
+				localChange = fmaxf(localChange, tiledUpdate(oldGrid, newGrid, steps, extent, 1));
+				profileMark(&profile, PROFILE_EDGE);
+			}
+			else
+			{
+				//
+				// Perform the calculations, split into interior and edge points to help with the conversion to non-blocking.
+				// Rows are shared between threads with the same static schedule used in initialiseGrid(), so each
+				// thread mostly works on memory that it touched first, i.e. that is local to its socket.
+				//
+
+				// First update the interior grid points (using a Jacobi iteration). Also find the largest change to
+				// any cell, to test for convergence.
+#pragma omp parallel for reduction(max : localChange) schedule(static)
+				for (row = 2; row < localRows; row++)
+					localChange = fmaxf(localChange, updateRow(newGrid, oldGrid, row, 2, localCols - 2));
+				profileMark(&profile, PROFILE_INTERIOR);
+
+				// Wait until the ghost cells have arrived (and the edge cells have been sent) before updating the edges.
+				if (step == 0)
+					haloFinish(&halo[current]);
+
+				// Now update the edge cells, i.e. those that need to read the ghost cells, and any ghost cells that
+				// will be needed before the next exchange. Including the latter in localChange does not change the
+				// global maximum, as they are the same as the neighbours' cells. These are whole rows at the top
+				// and bottom, and just the columns either side of the interior in between.
+				int colLo = 1 - extent[HALO_LEFT], colHi = localCols + 1 + extent[HALO_RIGHT];
+#pragma omp parallel for reduction(max : localChange) schedule(static)
+				for (row = 1 - extent[HALO_UP]; row < localRows + 1 + extent[HALO_DOWN]; row++)
+					if (row <= 1 || row >= localRows)
+						localChange = fmaxf(localChange, updateRow(newGrid, oldGrid, row, colLo, colHi - colLo));
+					else
+					{
+						localChange = fmaxf(localChange, updateRow(newGrid, oldGrid, row, colLo, 2 - colLo));
+						localChange = fmaxf(localChange, updateRow(newGrid, oldGrid, row, localCols, colHi - localCols));
+					}
+				profileMark(&profile, PROFILE_EDGE);
+			}
+
+			// The time spent computing, i.e. excluding the halo exchange, measures this process's speed.
+			if (rebalanceInterval > 0)
+				rebalance.time += MPI_Wtime() - computeStart - (haloPostTime + haloWaitTime - exchangeStart);
+
+			// The new grid becomes the current one.
+			current = 1 - current;
 		}
-		if (rowBlock > 0)
+		iter += steps - 1;
+
+		// Save a checkpoint every checkpointInterval iterations (with temporal tiling, as soon as possible after).
+		if (checkpointName && checkpointInterval > 0 && (iter + 1) / checkpointInterval > (iter + 1 - steps) / checkpointInterval)
+			checkpointWrite(&checkpoint, halo[current].grid, iter + 1);
+
+		// Likewise for snapshots.
+		if (snapshotPrefix && snapshotInterval > 0 && (iter + 1) / snapshotInterval > (iter + 1 - steps) / snapshotInterval)
 		{
-			MPI_Wait(&request_recv_lower, MPI_STATUS_IGNORE);
+			if (numIORanks > 0)
+				snapshotClientSend(&snapshotClient, outputGrid(halo[current].grid, view), ghostWidth, rowStride, iter + 1);
+			else
+				snapshotWrite(&snapshot, outputGrid(halo[current].grid, view), snapshotPrefix, snapshotFormat, iter + 1);
 		}
+		profileMark(&profile, PROFILE_IO);
 
-		// Left boundary.
-		if (colBlock > 0)
+		// Stop once the largest change anywhere is within the tolerance. The global maximum was started one
+		// iteration ago so that it completes in the background while this iteration is computed; hence
+		// this may perform one iteration more than strictly needed (or with -tasks, one more batch of iterations).
+		if (reduceRequest != MPI_REQUEST_NULL)
 		{
-			for (row = 1; row < local_L + 1; row++)
-				column[row - 1] = grid[_index(row, 1)];
-			MPI_Send(column, local_L, MPI_FLOAT, rank - 1, 0, MPI_COMM_WORLD);
+			MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE);
+			converged = (maxChange <= tolerance);
 		}
-		if (colBlock < p - 1)
+
+		// Only start the reduction every few iterations, to amortise its cost. With temporal tiling, localChange
+		// is from the last iteration of the tiles, i.e. the first multiple of checkInterval may have been passed.
+		if (tolerance > 0.0f && !converged && (iter + 1) / checkInterval > (iter + 1 - steps) / checkInterval)
 		{
-			MPI_Recv(column, local_L, MPI_FLOAT, rank + 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-			for (row = 1; row < local_L + 1; row++)
-				grid[_index(row, local_L + 1)] = column[row - 1];
+			reduceChange = localChange;
+			MPI_Iallreduce(&reduceChange, &maxChange, 1, MPI_FLOAT, MPI_MAX, gridComm, &reduceRequest);
 		}
+		profileMark(&profile, PROFILE_REDUCE);
 
-		// Right boundary.
-		if (colBlock < p - 1)
+		// Every rebalanceInterval iterations, move cells from slower processes to faster ones if that is worthwhile.
+		// The next iteration then starts with an exchange, as rebalanceInterval is a multiple of ghostWidth.
+		if (rebalanceInterval > 0 && (iter + 1 - firstIter) % rebalanceInterval == 0 && iter + 1 < numIterations && rebalancePartition(&rebalance, rowStarts, colStarts))
 		{
-			for (row = 1; row < local_L + 1; row++)
-				column[row - 1] = grid[_index(row, local_L)];
-			MPI_Send(column, local_L, MPI_FLOAT, rank + 1, 0, MPI_COMM_WORLD);
+			repartition(&rebalance, halo, current, backend, rowStarts, colStarts);
+			current = 0;
+			numRebalances++;
 		}
-		if (colBlock > 0)
+		profileMark(&profile, PROFILE_REBALANCE);
+		profileIteration(&profile, iter + 1);
+	}
+
+	// Go back to equal blocks, for the output. Report the final partition first.
+	if (rebalanceInterval > 0)
+	{
+		if (rank == 0 && !results)
 		{
-			MPI_Recv(column, local_L, MPI_FLOAT, rank - 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-			for (row = 1; row < local_L + 1; row++)
-				grid[_index(row, 0)] = column[row - 1];
+			printf("\nRebalanced %d time(s); block heights", numRebalances);
+			for (i = 0; i < p; i++)
+				printf(" %d", rebalance.rowStarts[i + 1] - rebalance.rowStarts[i]);
+			printf(", widths");
+			for (i = 0; i < p; i++)
+				printf(" %d", rebalance.colStarts[i + 1] - rebalance.colStarts[i]);
+			printf(".\n");
 		}
+		for (i = 0; i <= p; i++)
+			rowStarts[i] = colStarts[i] = i * local_L;
+		repartition(&rebalance, halo, current, backend, rowStarts, colStarts);
+		current = 0;
+		rebalanceFree(&rebalance);
+		free(rowStarts);
+	}
+	grid = outputGrid(halo[current].grid, view);
 
-		//
-		// Perform the calculations, split into interior and edge points to help with the conversion to non-blocking.
-		//
+	// A reduction may still be in progress if the maximum number of iterations was reached.
+	if (reduceRequest != MPI_REQUEST_NULL)
+	{
+		MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE);
+		converged = (maxChange <= tolerance);
+	}
+	profileMark(&profile, PROFILE_REDUCE);
 
-		// First update the interior grid points (using a Jacobi iteration).
-		for (row = 2; row < local_L; row++)
-			for (col = 2; col < local_L; col++)
-				grid[_index(row, col)] = 0.25 * (grid[_index(row + 1, col)] + grid[_index(row - 1, col)] + grid[_index(row, col + 1)] + grid[_index(row, col - 1)]);
+	// Calculate how long the calculation took.
+	double endTime = MPI_Wtime();
 
-		// Now update the edge cells, i.e. those that need to read the ghost cells.
+	// Save the final grid.
+	if (checkpointName)
+	{
+		checkpointWrite(&checkpoint, grid, iter);
+		checkpointFree(&checkpoint);
+	}
+	if (numIORanks > 0)
+	{
+		snapshotClientSend(&snapshotClient, grid, ghostWidth, rowStride, iter);
+		snapshotClientFree(&snapshotClient);
+	}
+	else if (snapshotPrefix)
+		snapshotWrite(&snapshot, grid, snapshotPrefix, snapshotFormat, iter);
+
+	// Display the final grid and the time taken, except for an ensemble.
+	if (!results)
+	{
+		if (rank == 0)
+			printf("\nFinal grid:\n");
+		displayGrid(&snapshot, grid, rank, p);
+	}
+	int numThreads = 1;
+#ifdef _OPENMP
+	numThreads = omp_get_max_threads();
+#endif
+	if (rank == 0 && !results)
+	{
+		if (tolerance > 0.0f)
+			printf("\n%s after %d iterations; largest change when last checked %g.\n", converged ? "Converged" : "Not converged", iter, maxChange);
+		if (solver == SOLVER_EXPLICIT || solver == SOLVER_ADI || solver == SOLVER_GRAY_SCOTT)
+			printf("\nSimulated time: %g (%d steps of %g).\n", iter * timeStep, iter, timeStep);
+		printf("\nTime taken: %g s (solver: %s, halo exchange: %s, %d thread(s) per process).\n", endTime - startTime, solverNames[solver], haloBackendNames[backend], numThreads);
+	}
+
+	// Or, for an ensemble, return them, along with the mean of the final grid.
+	if (results)
+	{
+		double sum = 0.0, total;
+#pragma omp parallel for reduction(+ : sum) schedule(static)
 		for (row = 1; row < local_L + 1; row++)
+		{
+			int col;
 			for (col = 1; col < local_L + 1; col++)
-				if (row == 1 || row == local_L || col == 1 || col == local_L)
-					grid[_index(row, col)] = 0.25 * (grid[_index(row + 1, col)] + grid[_index(row - 1, col)] + grid[_index(row, col + 1)] + grid[_index(row, col - 1)]);
-	}
+				sum += grid[_index(row, col)];
+		}
+		MPI_Reduce(&sum, &total, 1, MPI_DOUBLE, MPI_SUM, 0, gridComm);
 
-	// Calculate how long the calculation took.
-	double endTime = MPI_Wtime();
+		memset(results, 0, ENSEMBLE_NUM_RESULTS * sizeof(double));
+		results[ENSEMBLE_ITERATIONS] = iter;
+		results[ENSEMBLE_CONVERGED] = (tolerance > 0.0f && converged);
+		results[ENSEMBLE_CHANGE] = (tolerance > 0.0f ? maxChange : 0.0);
+		results[ENSEMBLE_MEAN] = total / ((double)L * L);
+		results[ENSEMBLE_TIME] = endTime - startTime;
+	}
 
-	// Display the final grid and the time taken.
-	if (rank == 0)
-		printf("\nFinal grid:\n");
-	displayGrid(grid, rank, p);
-	if (rank == 0)
-		printf("\nTime taken: %g s.\n", endTime - startTime);
+	// Write the profile of the iterations.
+	if (profileName)
+	{
+		char label[256];
+		snprintf(label, sizeof(label), "L %d, solver %s, halo exchange %s, %d thread(s) per process", L, solverNames[solver], haloBackendNames[backend], numThreads);
+		profileReport(&profile, gridComm, profileName, profileFormat, label);
+	}
+	if (tracePrefix)
+		profileTrace(&profile, gridComm, tracePrefix);
+	profileFree(&profile);
 
 	//
 	// Clear up and quit.
 	//
-	free(grid);
-	free(column);
-	MPI_Finalize();
-	return EXIT_SUCCESS;
+	if (solver == SOLVER_SOR)
+		for (i = 0; i < 2; i++)
+			haloFree(&colourHalo[i]);
+	if (solver == SOLVER_MULTIGRID)
+		mgFree(&mg);
+	if (solver == SOLVER_CG || solver == SOLVER_PIPELINED_CG)
+		cgFree(&cg);
+	if (solver == SOLVER_ADI)
+		adiFree(&adi);
+	if (solver == SOLVER_EXPLICIT || solver == SOLVER_ADI)
+		diffusionFree(&diffusion);
+	if (gathered)
+		snapshotFree(&snapshot);
+	free(view);
+	for (i = 0; i < numGrids; i++)
+		haloFree(&halo[i]); // Also frees the grids.
+	MPI_Comm_free(&gridComm);
+	if (numIORanks > 0)
+	{
+		MPI_Comm_free(&computeComm);
+		MPI_Comm_free(&snapshotComm);
+	}
+	return 0;
 }
 
 //
 // Functions.
 //
 
-// Have used 1D arrays (rather than 2D), so perform the indexing 'by hand.'
-int _index(int row, int col) { return row * (local_L + 2) + col; }
+// Parses the command line options, all of which are optional:
+//
+// -L <size>          : the global grid size L (default 8).
+// -iterations <n>    : the (maximum) number of iterations (default 10).
+// -tolerance <tol>   : stop once no cell changes by more than this in an iteration (default 0, i.e. never).
+// -checkInterval <n> : test for convergence every n iterations (default 10).
+// -halo <name>       : the ghost-cell exchange backend; one of the names in haloBackendNames[] (default 'persistent').
+// -ghost <k>         : the number of layers of ghost cells, exchanged every k iterations (default 1).
+// -tile <size>       : perform the k iterations between exchanges tile by tile (default 0, i.e. no tiling).
+// -tasks <size>      : update size*size sub-blocks as OpenMP tasks (default 0, i.e. parallel loops over the whole grid).
+// -solver <name>     : the iterative method; one of the names in solverNames[] (default 'jacobi').
+// -omega <w>         : the SOR relaxation factor, between 0 and 2 (default the optimum).
+// -preconditioner <name> : for conjugate gradients; one of the names in cgPreconditionerNames[] (default 'jacobi').
+// -diffusivity <D>   : for the explicit and ADI solvers, the diffusivity (default 1).
+// -dt <dt>           : for the explicit and ADI solvers, the time step (default the largest that is stable explicitly).
+// -dx <dx>           : for the explicit and ADI solvers, the distance between cells (default 1/(L+1)).
+// -coefficients <field> : for the explicit and ADI solvers, one of the names in diffusionFieldNames[] (default 'uniform').
+// -contrast <c>      : for the explicit and ADI solvers, how many times larger D is in parts of the field (default 10).
+// -source <q>        : for the explicit and ADI solvers, the heating rate of the heater in the middle (default 0).
+// -du <D>            : for the Gray-Scott solver, the diffusivity of u (default 0.16).
+// -dv <D>            : for the Gray-Scott solver, the diffusivity of v (default 0.08).
+// -feed <F>          : for the Gray-Scott solver, the rate at which u is fed in (default 0.035).
+// -kill <k>          : for the Gray-Scott solver, the rate at which v is removed, in addition to F (default 0.065).
+// -checkpoint <file> : save checkpoints to this file (default none).
+// -checkpointInterval <n> : save a checkpoint every n iterations, as well as at the end (default 0, i.e. only at the end).
+// -checkpointMode <mode> : 'blocking' (the default) or 'nonblocking', to write checkpoints in the background.
+// -restart <file>    : continue from this checkpoint file (default none).
+// -snapshot <prefix> : write snapshots to files <prefix>_<iteration>.<format> (default none).
+// -snapshotInterval <n> : write a snapshot every n iterations, as well as at the end (default 0, i.e. only at the end).
+// -snapshotFormat <format> : one of the names in snapshotFormatNames[] (default 'pgm').
+// -ioRanks <k>       : dedicate the last k processes to writing the snapshots (default 0, i.e. rank 0 writes them).
+// -profile <file>    : write the time spent in each phase of the iterations to this file (default none).
+// -profileFormat <format> : 'json' (the default) or 'csv'.
+// -trace <prefix>    : write the time spent in each phase of every iteration to <prefix>_<rank>.csv (default none).
+// -rebalance <M>     : balance the load between processes every M iterations (default 0, i.e. never).
+// -ensemble <file>   : run the simulations listed in this file, one per line (default none).
+// -groupSize <n>     : the number of processes for each simulation of an ensemble (default 1).
+//
+// Every option is first set to its default, so that each member of an ensemble only gets its own options.
+// Only rank 0 prints error messages, but all ranks return -1 if the options are invalid.
+int parseCommandLine(int argc, char **argv, int rank, HaloBackend *backend)
+{
+	int i, b;
+
+	*backend = HALO_PERSISTENT;
+	L = 8;
+	numIterations = 10;
+	tolerance = 0.0f;
+	checkInterval = 10;
+	ghostWidth = 1;
+	tileSize = taskSize = 0;
+	solver = SOLVER_JACOBI;
+	omega = 0.0f;
+	preconditioner = CG_JACOBI;
+	diffusivity = 1.0;
+	timeStep = gridSpacing = heatSource = 0.0;
+	diffusionField = DIFFUSION_UNIFORM;
+	diffusionContrast = 10.0;
+	speciesDiffusivity[0] = 0.16;
+	speciesDiffusivity[1] = 0.08;
+	feedRate = 0.035;
+	killRate = 0.065;
+	checkpointName = restartName = snapshotPrefix = profileName = tracePrefix = ensembleName = NULL;
+	checkpointInterval = checkpointNonblocking = snapshotInterval = numIORanks = rebalanceInterval = 0;
+	snapshotFormat = SNAPSHOT_PGM;
+	profileFormat = PROFILE_JSON;
+	groupSize = 1;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-L") && i + 1 < argc)
+		{
+			if ((L = atoi(argv[++i])) <= 0)
+			{
+				if (rank == 0)
+					printf("Error: The grid size L must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc)
+		{
+			if ((numIterations = atoi(argv[++i])) < 0)
+			{
+				if (rank == 0)
+					printf("Error: The number of iterations cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-tolerance") && i + 1 < argc)
+		{
+			if ((tolerance = atof(argv[++i])) < 0.0f)
+			{
+				if (rank == 0)
+					printf("Error: The tolerance cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-checkInterval") && i + 1 < argc)
+		{
+			if ((checkInterval = atoi(argv[++i])) <= 0)
+			{
+				if (rank == 0)
+					printf("Error: The convergence check interval must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-ghost") && i + 1 < argc)
+		{
+			if ((ghostWidth = atoi(argv[++i])) <= 0)
+			{
+				if (rank == 0)
+					printf("Error: The number of ghost layers must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-tile") && i + 1 < argc)
+		{
+			if ((tileSize = atoi(argv[++i])) < 0)
+			{
+				if (rank == 0)
+					printf("Error: The tile size cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-tasks") && i + 1 < argc)
+		{
+			if ((taskSize = atoi(argv[++i])) < 0)
+			{
+				if (rank == 0)
+					printf("Error: The sub-block size cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-solver") && i + 1 < argc)
+		{
+			for (b = 0; b < NUM_SOLVERS && strcmp(argv[i + 1], solverNames[b]); b++)
+				;
+			if (b == NUM_SOLVERS)
+			{
+				if (rank == 0)
+					printf("Error: Unknown solver '%s'.\n", argv[i + 1]);
+				return -1;
+			}
+			solver = b;
+			i++;
+		}
+		else if (!strcmp(argv[i], "-omega") && i + 1 < argc)
+		{
+			omega = atof(argv[++i]);
+			if (omega <= 0.0f || omega >= 2.0f)
+			{
+				if (rank == 0)
+					printf("Error: The relaxation factor must be between 0 and 2.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-preconditioner") && i + 1 < argc)
+		{
+			for (b = 0; b < CG_NUM_PRECONDITIONERS && strcmp(argv[i + 1], cgPreconditionerNames[b]); b++)
+				;
+			if (b == CG_NUM_PRECONDITIONERS)
+			{
+				if (rank == 0)
+					printf("Error: Unknown preconditioner '%s'.\n", argv[i + 1]);
+				return -1;
+			}
+			preconditioner = b;
+			i++;
+		}
+		else if (!strcmp(argv[i], "-diffusivity") && i + 1 < argc)
+		{
+			if ((diffusivity = atof(argv[++i])) <= 0.0)
+			{
+				if (rank == 0)
+					printf("Error: The diffusivity must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-dt") && i + 1 < argc)
+		{
+			if ((timeStep = atof(argv[++i])) <= 0.0)
+			{
+				if (rank == 0)
+					printf("Error: The time step must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-dx") && i + 1 < argc)
+		{
+			if ((gridSpacing = atof(argv[++i])) <= 0.0)
+			{
+				if (rank == 0)
+					printf("Error: The grid spacing must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-coefficients") && i + 1 < argc)
+		{
+			if ((b = diffusionFieldFromName(argv[++i])) == -1)
+			{
+				if (rank == 0)
+					printf("Error: Unknown diffusivity field '%s'.\n", argv[i]);
+				return -1;
+			}
+			diffusionField = b;
+		}
+		else if (!strcmp(argv[i], "-contrast") && i + 1 < argc)
+		{
+			if ((diffusionContrast = atof(argv[++i])) <= 0.0)
+			{
+				if (rank == 0)
+					printf("Error: The diffusivity contrast must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-source") && i + 1 < argc)
+			heatSource = atof(argv[++i]);
+		else if ((!strcmp(argv[i], "-du") || !strcmp(argv[i], "-dv")) && i + 1 < argc)
+		{
+			if ((speciesDiffusivity[argv[i][2] == 'v'] = atof(argv[i + 1])) <= 0.0)
+			{
+				if (rank == 0)
+					printf("Error: The diffusivities must be positive.\n");
+				return -1;
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-feed") && i + 1 < argc)
+		{
+			if ((feedRate = atof(argv[++i])) < 0.0)
+			{
+				if (rank == 0)
+					printf("Error: The feed rate cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-kill") && i + 1 < argc)
+		{
+			if ((killRate = atof(argv[++i])) < 0.0)
+			{
+				if (rank == 0)
+					printf("Error: The kill rate cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-checkpoint") && i + 1 < argc)
+			checkpointName = argv[++i];
+		else if (!strcmp(argv[i], "-checkpointInterval") && i + 1 < argc)
+		{
+			if ((checkpointInterval = atoi(argv[++i])) < 0)
+			{
+				if (rank == 0)
+					printf("Error: The checkpoint interval cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-checkpointMode") && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "blocking") && strcmp(argv[i], "nonblocking"))
+			{
+				if (rank == 0)
+					printf("Error: The checkpoint mode must be 'blocking' or 'nonblocking'.\n");
+				return -1;
+			}
+			checkpointNonblocking = !strcmp(argv[i], "nonblocking");
+		}
+		else if (!strcmp(argv[i], "-restart") && i + 1 < argc)
+			restartName = argv[++i];
+		else if (!strcmp(argv[i], "-snapshot") && i + 1 < argc)
+			snapshotPrefix = argv[++i];
+		else if (!strcmp(argv[i], "-snapshotInterval") && i + 1 < argc)
+		{
+			if ((snapshotInterval = atoi(argv[++i])) < 0)
+			{
+				if (rank == 0)
+					printf("Error: The snapshot interval cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-snapshotFormat") && i + 1 < argc)
+		{
+			if ((b = snapshotFormatFromName(argv[++i])) == -1)
+			{
+				if (rank == 0)
+					printf("Error: Unknown snapshot format '%s'.\n", argv[i]);
+				return -1;
+			}
+			snapshotFormat = b;
+		}
+		else if (!strcmp(argv[i], "-ioRanks") && i + 1 < argc)
+			numIORanks = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-profile") && i + 1 < argc)
+			profileName = argv[++i];
+		else if (!strcmp(argv[i], "-profileFormat") && i + 1 < argc)
+		{
+			if ((b = profileFormatFromName(argv[++i])) == -1)
+			{
+				if (rank == 0)
+					printf("Error: The profile format must be 'json' or 'csv'.\n");
+				return -1;
+			}
+			profileFormat = b;
+		}
+		else if (!strcmp(argv[i], "-trace") && i + 1 < argc)
+			tracePrefix = argv[++i];
+		else if (!strcmp(argv[i], "-rebalance") && i + 1 < argc)
+		{
+			if ((rebalanceInterval = atoi(argv[++i])) < 0)
+			{
+				if (rank == 0)
+					printf("Error: The rebalancing interval cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-ensemble") && i + 1 < argc)
+			ensembleName = argv[++i];
+		else if (!strcmp(argv[i], "-groupSize") && i + 1 < argc)
+		{
+			if ((groupSize = atoi(argv[++i])) <= 0)
+			{
+				if (rank == 0)
+					printf("Error: The group size must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-halo") && i + 1 < argc)
+		{
+			if ((b = haloBackendFromName(argv[++i])) == -1)
+			{
+				if (rank == 0)
+					printf("Error: Unknown halo exchange backend '%s'.\n", argv[i]);
+				return -1;
+			}
+			*backend = b;
+		}
+		else
+		{
+			if (rank == 0)
+			{
+				printf("Call as\n\nmpiexec -n <p*p> ./heatEqn [-L <size>] [-iterations <n>] [-tolerance <tol>] [-checkInterval <n>] [-halo <backend>] [-ghost <k>] [-tile <size>] [-tasks <size>] [-solver <solver>] [-omega <w>] [-preconditioner <name>] [-diffusivity <D>] [-dt <dt>] [-dx <dx>] [-coefficients <field>] [-contrast <c>] [-source <q>] [-du <D>] [-dv <D>] [-feed <F>] [-kill <k>] [-checkpoint <file>] [-checkpointInterval <n>] [-checkpointMode <mode>] [-restart <file>] [-snapshot <prefix>] [-snapshotInterval <n>] [-snapshotFormat <format>] [-ioRanks <k>] [-profile <file>] [-profileFormat <format>] [-trace <prefix>] [-rebalance <M>] [-ensemble <file>] [-groupSize <n>]\n\nwhere <backend> is one of:");
+				for (b = 0; b < HALO_NUM_BACKENDS; b++)
+					printf(" %s", haloBackendNames[b]);
+				printf("\nand <solver> is one of:");
+				for (b = 0; b < NUM_SOLVERS; b++)
+					printf(" %s", solverNames[b]);
+				printf("\nand <name> is one of:");
+				for (b = 0; b < CG_NUM_PRECONDITIONERS; b++)
+					printf(" %s", cgPreconditionerNames[b]);
+				printf("\nand <field> is one of:");
+				for (b = 0; b < DIFFUSION_NUM_FIELDS; b++)
+					printf(" %s", diffusionFieldNames[b]);
+				printf("\nand <format> is one of:");
+				for (b = 0; b < SNAPSHOT_NUM_FORMATS; b++)
+					printf(" %s", snapshotFormatNames[b]);
+				printf("\n");
+			}
+			return -1;
+		}
+	}
+
+	// I/O ranks only write snapshots, so are of no use without them.
+	if (numIORanks < 0 || (numIORanks > 0 && !snapshotPrefix))
+	{
+		if (rank == 0)
+			printf("Error: I/O ranks need -snapshot, and their number cannot be negative.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Runs the ensemble listed in the file ensembleName (see heatEqn_ensemble.h). Rank 0 hands out the members,
+// and the other processes run them in groups of groupSize, each member with the options on the command line
+// followed by those on its line of the file. Returns -1 (on every process) if the processes cannot be split
+// into such groups, or the file cannot be opened.
+int ensemble(int argc, char **argv, int provided)
+{
+	int rank, numProcs, status = 0;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &numProcs);
+
+	if (numProcs < 1 + groupSize || (numProcs - 1) % groupSize)
+	{
+		if (rank == 0)
+			printf("An ensemble needs one process to hand out the simulations, plus a multiple of the group size %d.\n", groupSize);
+		return -1;
+	}
+
+	// Rank 0 is in a group of its own, though it does not use it.
+	MPI_Comm groupComm;
+	MPI_Comm_split(MPI_COMM_WORLD, (rank == 0 ? 0 : 1 + (rank - 1) / groupSize), rank, &groupComm);
+	if (rank == 0)
+		status = ensembleServe(MPI_COMM_WORLD, ensembleName, groupSize);
+	else
+	{
+		// The options on the command line, then room for those on the line of the file (which are at least two
+		// characters apart).
+		Ensemble ens;
+		double results[ENSEMBLE_NUM_RESULTS];
+		char **args = (char **)malloc((argc + ENSEMBLE_LINE_MAX / 2) * sizeof(char *)), *token;
+		memcpy(args, argv, argc * sizeof(char *));
+
+		ensembleCreate(&ens, MPI_COMM_WORLD, groupComm);
+		while (ensembleNext(&ens, results) != -1)
+		{
+			// A member that fails reports nothing else.
+			memset(results, 0, sizeof(results));
+			int numArgs = argc;
+			for (token = strtok(ens.options, " \t"); token; token = strtok(NULL, " \t"))
+				args[numArgs++] = token;
+
+			HaloBackend backend;
+			if (parseCommandLine(numArgs, args, ens.groupRank, &backend) == -1 || simulate(groupComm, backend, provided, results) == -1)
+				results[ENSEMBLE_FAILED] = 1.0;
+		}
+		free(args);
+	}
+
+	MPI_Comm_free(&groupComm);
+	MPI_Bcast(&status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	return status;
+}
+
+// Performs 'steps' iterations, reading from oldGrid and writing to newGrid, one tile at a time. The ghost
+// cells of oldGrid must be valid to a depth of at least 'steps' on the sides with neighbours, i.e. those with
+// a non-zero extent[] (which is ghostWidth-1 on those sides). Only the tiles that depend on the ghost cells
+// are updated if edgeTiles is non-zero, and only those that do not otherwise. Returns the largest change
+// to any cell of these tiles in the last iteration.
+float tiledUpdate(const float *oldGrid, float *newGrid, int steps, const int *extent, int edgeTiles)
+{
+	int tile, numTileRows = (localRows + tileSize - 1) / tileSize, numTileCols = (localCols + tileSize - 1) / tileSize, width = tileSize + 2 * steps;
+	float change = 0.0f;
+
+#pragma omp parallel reduction(max : change)
+	{
+		// Each thread updates its tiles in two small arrays, swapping between them each iteration.
+		float *scratch[2];
+		scratch[0] = (float *)malloc(2 * (size_t)width * width * sizeof(float));
+		scratch[1] = scratch[0] + (size_t)width * width;
+
+#pragma omp for schedule(dynamic)
+		for (tile = 0; tile < numTileRows * numTileCols; tile++)
+		{
+			int row, t;
+
+			// The cells in this tile, i.e. rows [r0,r1) and columns [c0,c1).
+			int r0 = 1 + (tile / numTileCols) * tileSize, r1 = (r0 + tileSize < localRows + 1 ? r0 + tileSize : localRows + 1);
+			int c0 = 1 + (tile % numTileCols) * tileSize, c1 = (c0 + tileSize < localCols + 1 ? c0 + tileSize : localCols + 1);
+			if ((r0 - steps < 1 || r1 - 1 + steps > localRows || c0 - steps < 1 || c1 - 1 + steps > localCols) != edgeTiles)
+				continue;
+
+			// The cells that the tile's final values depend on, i.e. the tile expanded by 'steps', but not
+			// beyond the (fixed) boundary cells at the edge of the domain.
+			int rowLo = (r0 - steps > -extent[HALO_UP] ? r0 - steps : -extent[HALO_UP]);
+			int rowHi = (r1 + steps < localRows + 2 + extent[HALO_DOWN] ? r1 + steps : localRows + 2 + extent[HALO_DOWN]);
+			int colLo = (c0 - steps > -extent[HALO_LEFT] ? c0 - steps : -extent[HALO_LEFT]);
+			int colHi = (c1 + steps < localCols + 2 + extent[HALO_RIGHT] ? c1 + steps : localCols + 2 + extent[HALO_RIGHT]);
+			int w = colHi - colLo;
+
+			// Copy them into both arrays, so both have the cells that are read but not updated.
+			for (row = rowLo; row < rowHi; row++)
+			{
+				memcpy(&scratch[0][(row - rowLo) * w], &oldGrid[_index(row, colLo)], w * sizeof(float));
+				memcpy(&scratch[1][(row - rowLo) * w], &oldGrid[_index(row, colLo)], w * sizeof(float));
+			}
+
+			// Each iteration updates one fewer layer of cells around the tile, as in the main loop; the last
+			// updates just the tile, so its changes are the ones that count.
+			for (t = 0; t < steps; t++)
+			{
+				int grow = steps - 1 - t;
+				int i0 = (r0 - grow > rowLo + 1 ? r0 - grow : rowLo + 1) - rowLo, i1 = (r1 + grow < rowHi - 1 ? r1 + grow : rowHi - 1) - rowLo;
+				int j0 = (c0 - grow > colLo + 1 ? c0 - grow : colLo + 1) - colLo, j1 = (c1 + grow < colHi - 1 ? c1 + grow : colHi - 1) - colLo;
+				for (row = i0; row < i1; row++)
+				{
+					float rowChange = stencilRow(&scratch[1 - t % 2][row * w + j0], &scratch[t % 2][row * w + j0], w, j1 - j0);
+					if (t == steps - 1)
+						change = fmaxf(change, rowChange);
+				}
+			}
+
+			// Copy the tile itself back.
+			for (row = r0; row < r1; row++)
+				memcpy(&newGrid[_index(row, c0)], &scratch[steps % 2][(row - rowLo) * w + (c0 - colLo)], (c1 - c0) * sizeof(float));
+		}
+
+		free(scratch[0]);
+	}
+
+	return change;
+}
+
+// Updates the cells of sub-block (i,j) of the local grid (see taskUpdate()), reading from oldGrid and writing
+// to newGrid. Returns the largest change to any of them.
+static float taskBlock(const float *oldGrid, float *newGrid, int i, int j)
+{
+	int row, r0 = 1 + i * taskSize, r1 = (r0 + taskSize < localRows + 1 ? r0 + taskSize : localRows + 1);
+	int c0 = 1 + j * taskSize, c1 = (c0 + taskSize < localCols + 1 ? c0 + taskSize : localCols + 1);
+	float change = 0.0f;
+
+	for (row = r0; row < r1; row++)
+		change = fmaxf(change, updateRow(newGrid, oldGrid, row, c0, c1 - c0));
+	return change;
+}
+
+// Performs 'steps' iterations, starting from halo[current].grid and swapping between the two grids, as a graph
+// of OpenMP tasks: one per taskSize*taskSize sub-block per iteration, and one per iteration that exchanges the
+// ghost cells. The dependencies are declared on the first cell of each sub-block, standing for the whole
+// sub-block, and on the corner ghost cell, standing for all the ghost cells. Updating a sub-block reads the
+// sub-block and its four neighbours from the previous iteration (and the ghost cells, on the edge of the local
+// grid), and writes the sub-block; the exchange reads the sub-blocks on the edge and writes the ghost cells.
+// Those are also all the dependencies needed to not overwrite anything still being read, as each grid is
+// written every other iteration. So each sub-block is updated as soon as its own inputs are ready, with no
+// barrier until the end. Returns the largest change to any cell in the last iteration.
+float taskUpdate(HaloExchange *halo, int current, int steps)
+{
+	int b, numRows = (localRows + taskSize - 1) / taskSize, numCols = (localCols + taskSize - 1) / taskSize, numBlocks = numRows * numCols;
+	int numEdges = 0, *edges = (int *)malloc(numBlocks * sizeof(int));
+	size_t *first = (size_t *)malloc(numBlocks * sizeof(size_t));
+	float change = 0.0f, *changes = (float *)malloc(numBlocks * sizeof(float));
+
+	for (b = 0; b < numBlocks; b++)
+	{
+		first[b] = _index(1 + (b / numCols) * taskSize, 1 + (b % numCols) * taskSize);
+		if (b < numCols || b >= numBlocks - numCols || b % numCols == 0 || b % numCols == numCols - 1)
+			edges[numEdges++] = b;
+	}
+
+#pragma omp parallel
+#pragma omp single
+	{
+		// Declared here, so that each task gets its own copy.
+		int step, block;
+		for (step = 0; step < steps; step++)
+		{
+			HaloExchange *exchange = &halo[(current + step) % 2];
+			float *oldGrid = exchange->grid, *newGrid = halo[1 - (current + step) % 2].grid;
+
+			// Created first, so that it tends to be started as soon as the edges are ready.
+#pragma omp task depend(iterator(k = 0 : numEdges), in : oldGrid[first[edges[k]]]) depend(out : oldGrid[0])
+			{
+				haloStart(exchange);
+				haloFinish(exchange);
+			}
+
+			for (block = 0; block < numBlocks; block++)
+			{
+				int i = block / numCols, j = block % numCols;
+				size_t up = first[i > 0 ? block - numCols : block], down = first[i < numRows - 1 ? block + numCols : block];
+				size_t left = first[j > 0 ? block - 1 : block], right = first[j < numCols - 1 ? block + 1 : block];
+
+				if (i == 0 || i == numRows - 1 || j == 0 || j == numCols - 1)
+				{
+#pragma omp task depend(in : oldGrid[first[block]], oldGrid[up], oldGrid[down], oldGrid[left], oldGrid[right], oldGrid[0]) depend(out : newGrid[first[block]])
+					changes[block] = taskBlock(oldGrid, newGrid, i, j);
+				}
+				else
+				{
+#pragma omp task depend(in : oldGrid[first[block]], oldGrid[up], oldGrid[down], oldGrid[left], oldGrid[right]) depend(out : newGrid[first[block]])
+					changes[block] = taskBlock(oldGrid, newGrid, i, j);
+				}
+			}
+		}
+	}
+
+	// The parallel region only ends once every task has, so these are from the last iteration.
+	for (b = 0; b < numBlocks; b++)
+		change = fmaxf(change, changes[b]);
+
+	free(edges);
+	free(first);
+	free(changes);
+	return change;
+}
+
+// Moves the Jacobi solver's two grids to the partition given by rowStarts and colStarts (see heatEqn_rebalance.h),
+// recreating their exchanges for the new size of this process's block. The current grid's cells are migrated
+// into the new halo[0]; the ghost cells are left at zero, i.e. the boundary condition, until the next exchange.
+void repartition(Rebalance *rb, HaloExchange *halo, int current, HaloBackend backend, const int *rowStarts, const int *colStarts)
+{
+	int i, row;
+	HaloExchange newHalo[2];
+
+	localRows = rowStarts[rb->coords[0] + 1] - rowStarts[rb->coords[0]];
+	localCols = colStarts[rb->coords[1] + 1] - colStarts[rb->coords[1]];
+
+	// Zero the new grids with the same static schedule as the iterations, as in initialiseGrid().
+	for (i = 0; i < 2; i++)
+	{
+		haloCreate(&newHalo[i], backend, rb->comm, localRows, localCols, ghostWidth);
+#pragma omp parallel for schedule(static)
+		for (row = 0; row < localRows + 2 * ghostWidth; row++)
+			memset(&newHalo[i].grid[(size_t)row * newHalo[i].stride], 0, newHalo[i].stride * sizeof(float));
+	}
+
+	rebalanceMigrate(rb, halo[current].grid, halo[current].stride, newHalo[0].grid, newHalo[0].stride, ghostWidth, rowStarts, colStarts);
+
+	for (i = 0; i < 2; i++)
+	{
+		haloFree(&halo[i]);
+		halo[i] = newHalo[i];
+	}
+	rowStride = halo[0].stride;
+}
+
+// Performs one iteration of red-black SOR on the grid, in place. colourHalo[0] and [1] exchange the red
+// and black cells respectively. Each colour starts by exchanging the other colour's edge cells, which were
+// just updated (or, for the first iteration, initialised); that overlaps with updating the interior
+// cells, which do not read the ghost cells. Returns the largest change to any cell.
+float sorIteration(float *grid, HaloExchange *colourHalo)
+{
+	int colour, row;
+	float change = 0.0f;
+
+	for (colour = 0; colour < 2; colour++)
+	{
+		int parity = colourHalo[colour].parity;
+
+		haloStart(&colourHalo[1 - colour]);
+
+#pragma omp parallel for reduction(max : change) schedule(static)
+		for (row = 2; row < local_L; row++)
+			change = fmaxf(change, sorRow(grid, row, 2, local_L, parity));
+
+		haloFinish(&colourHalo[1 - colour]);
+
+		// The edge cells: whole rows at the top and bottom, and the first and last columns in between.
+#pragma omp parallel for reduction(max : change) schedule(static)
+		for (row = 1; row < local_L + 1; row++)
+			if (row == 1 || row == local_L)
+				change = fmaxf(change, sorRow(grid, row, 1, local_L + 1, parity));
+			else
+			{
+				change = fmaxf(change, sorRow(grid, row, 1, 2, parity));
+				change = fmaxf(change, sorRow(grid, row, local_L, local_L + 1, parity));
+			}
+	}
+
+	return change;
+}
+
+// The grid to display or write: the grid itself, or for -solver gray-scott, its second field (v), copied into 'view'.
+float *outputGrid(float *grid, float *view)
+{
+	if (solver != SOLVER_GRAY_SCOTT)
+		return grid;
+
+	reactionField(view, grid, local_L, local_L, ghostWidth, rowStride, 1);
+	return view;
+}
 
 // Initialise the local grid for this process.
 void initialiseGrid(float *grid, int rank, int p)
 {
 	int i, j, l = local_L;
 
-	// Set all nodes to zero. This will be our boundary condition for this example.
-	for (i = 0; i < l + 2; i++)
-		for (j = 0; j < l + 2; j++)
+	// Set all nodes to zero. This will be our boundary condition for this example. This is the first
+	// time the grid is touched, so use the same static schedule as the iterations; the operating system
+	// then places each thread's rows in memory local to that thread.
+#pragma omp parallel for private(j) schedule(static)
+	for (i = 1 - ghostWidth; i < l + 1 + ghostWidth; i++)
+		for (j = 1 - ghostWidth; j < l + 1 + ghostWidth; j++)
 			grid[_index(i, j)] = 0.0f;
 
 	// Now overwrite the internal nodes with some values.
+#pragma omp parallel for private(j) schedule(static)
 	for (i = 1; i < l + 1; i++)
 		for (j = 1; j < l + 1; j++)
 			grid[_index(i, j)] = rank + 1;
 }
 
-// Displays the current grid. Uses point-to-point communication to send everything to rank 0,
-// which then prints in order.
-void displayGrid(float *grid, int rank, int p)
+// Displays the current grid. The whole grid is gathered onto rank 0 in a single collective (see
+// heatEqn_snapshot.h), which then prints it.
+void displayGrid(Snapshot *snapshot, float *grid, int rank, int p)
 {
-	int rowBlock, colBlock, row, col, source, l = local_L;
-	MPI_Status status;
+	int rowBlock, colBlock, row, col, l = local_L;
 
 	// Only display if small enough.
-	if (L > 32)
+	if (L > MAX_DISPLAY_L)
 	{
 		if (rank == 0)
 			printf("Not displaying grid; too big.\n");
 		return;
 	}
 
-	// Scratch array for reading in one row at a time.
-	float *scratch = (float *)malloc(l * sizeof(float));
+	snapshotGather(snapshot, grid);
+	if (rank != 0)
+		return;
 
 	// Print the upper row of (zero) boundary conditions, and a divider.
-	if (rank == 0)
+	printf("%6.3f | ", 0.0f);
+	for (colBlock = 0; colBlock < p; colBlock++)
 	{
-		printf("%6.3f | ", 0.0f);
-		for (colBlock = 0; colBlock < p; colBlock++)
-		{
-			for (col = 1; col < l + 1; col++)
-				printf("%6.3f ", 0.0f);
-			printf("| ");
-		}
-		printf("%6.3f\n", 0.0f);
-
-		for (col = 0; col < 7 * (p * l + 2) + 2 * (p + 1) - 1; col++)
-			printf("-");
-		printf("\n");
+		for (col = 1; col < l + 1; col++)
+			printf("%6.3f ", 0.0f);
+		printf("| ");
 	}
+	printf("%6.3f\n", 0.0f);
 
-	// Loop over processes in blocks of rows.
+	for (col = 0; col < 7 * (p * l + 2) + 2 * (p + 1) - 1; col++)
+		printf("-");
+	printf("\n");
+
+	// Loop over blocks of rows, then the rows in each block.
 	for (rowBlock = 0; rowBlock < p; rowBlock++)
 	{
-
-		// Loop over all rows in this rowBlock
-		for (row = 1; row < l + 1; row++)
+		for (row = 0; row < l; row++)
 		{
-			// Print the zero boundary value first, with a divider.
-			if (rank == 0)
-				printf("%6.3f | ", 0.0f);
-
-			// Now loop over the blocks of columns.
+			// Print the zero boundary value first, with a divider, then each block of columns, with vertical
+			// lines between blocks, and finally the right hand boundary value.
+			printf("%6.3f | ", 0.0f);
 			for (colBlock = 0; colBlock < p; colBlock++)
 			{
-				// The rank of the process with the data we need.
-				source = p * rowBlock + colBlock;
-
-				// If source matches this rank, we need to send data to rank 0 (unless we already are rank 0).
-				if (rank != 0)
-					if (source == rank)
-						MPI_Send(&grid[_index(row, 1)], l, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
-
-				// Display the data always from rank 0, to preserve ordering.
-				if (rank == 0)
-				{
-					if (source == 0)
-					{
-						for (col = 1; col < l + 1; col++)
-							printf("%6.3f ", grid[_index(row, col)]);
-					}
-					else
-					{
-						MPI_Recv(scratch, l, MPI_FLOAT, source, 0, MPI_COMM_WORLD, &status);
-						for (col = 1; col < l + 1; col++)
-							printf("%6.3f ", scratch[col - 1]);
-					}
-				}
-
-				// Add vertical lines between blocks.
-				if (rank == 0)
-					printf("| ");
+				for (col = 0; col < l; col++)
+					printf("%6.3f ", snapshot->image[(size_t)(rowBlock * l + row) * L + colBlock * l + col]);
+				printf("| ");
 			}
-
-			// End of row; print the right hand boundary value and a newline.
-			if (rank == 0)
-				printf("%6.3f\n", 0.0f);
+			printf("%6.3f\n", 0.0f);
 		}
 
 		// End of row block; print a divider (if not the last one).
-		if (rowBlock != p - 1 && rank == 0)
+		if (rowBlock != p - 1)
 		{
 			for (col = 0; col < 7 * (p * l + 2) + 2 * (p + 1) - 1; col++)
 				printf("-");
@@ -323,22 +1593,16 @@ void displayGrid(float *grid, int rank, int p)
 	}
 
 	// Plot last divider and final row of zero boundaries.
-	if (rank == 0)
-	{
-		for (col = 0; col < 7 * (p * l + 2) + 2 * (p + 1) - 1; col++)
-			printf("-");
-		printf("\n");
+	for (col = 0; col < 7 * (p * l + 2) + 2 * (p + 1) - 1; col++)
+		printf("-");
+	printf("\n");
 
-		printf("%6.3f | ", 0.0f);
-		for (colBlock = 0; colBlock < p; colBlock++)
-		{
-			for (col = 1; col < l + 1; col++)
-				printf("%6.3f ", 0.0f);
-			printf("| ");
-		}
-		printf("%6.3f\n", 0.0f);
+	printf("%6.3f | ", 0.0f);
+	for (colBlock = 0; colBlock < p; colBlock++)
+	{
+		for (col = 1; col < l + 1; col++)
+			printf("%6.3f ", 0.0f);
+		printf("| ");
 	}
-
-	// Clear up and return.
-	free(scratch);
+	printf("%6.3f\n", 0.0f);
 }
@@ -0,0 +1,401 @@
+//
+// MPI implementation of the heat equation (aka the diffusion equation) in 3D, using the same approach as
+// heatEqn.c, i.e. domain partitioning with ghost cells, but with a 7-point stencil on an L*L*L grid.
+//
+// Compile with:
+//
+// mpicc -Wall -O3 -march=native -fopenmp -o heatEqn3d heatEqn3d.c -lm
+//
+// and launch with any number of processes, e.g.
+//
+// mpiexec -n 8 ./heatEqn3d -L 256 -iterations 100
+//
+// The processes are arranged in a 3D grid chosen by MPI_Dims_create(), as close to a cube as possible, so that
+// the surface (i.e. ghost cells) to volume ratio of each block is as small as possible. The number of
+// processes in each direction must divide L. As in 2D, the ghost cells are exchanged with persistent
+// requests (see heatEqn_halo3d.h) while the interior of each block is updated, and the stencil is also
+// parallelised with OpenMP within each process.
+//
+// In 3D the faces are a much larger fraction of each block than the edges are in 2D: a block of n^3 cells
+// has 6n^2 face cells, against 4n edge cells for n^2 cells in 2D. So the exchanges are larger relative to
+// the computation, and their packing costs more. The dimensions are ordered so that the fewest processes
+// are across columns, which makes the faces that are expensive to pack (see heatEqn_halo3d.h) as small as
+// possible.
+//
+// The options -L, -iterations, -tolerance and -checkInterval are as for heatEqn.c. With -pack <packing>,
+// the faces between columns are either 'packed' by hand (the default) or described by subarray 'datatypes'.
+//
+
+//
+// Includes.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Ghost-cell exchange.
+#include "heatEqn_halo.h"
+#include "heatEqn_halo3d.h"
+
+//
+// Parameters and global variables.
+//
+#define MAX_DISPLAY_L 12 // Larger grids are not displayed.
+
+int L = 8;				// The global grid size, excluding the boundary. Can be set on the command line.
+int numIterations = 10; // The (maximum) number of iterations. Can be set on the command line.
+float tolerance = 0.0f; // Stop once no cell changes by more than this in one iteration. Zero to always iterate numIterations times.
+int checkInterval = 10; // How often (in iterations) to test for convergence.
+
+int local_L[3];		// The dimensions of the local grids: planes, rows and columns.
+size_t rowStride;	// The distance between rows in the local grids, including the ghost cells and padding.
+size_t planeStride; // The distance between planes.
+
+//
+// Function prototypes; definitions after main().
+//
+int parseCommandLine(int argc, char **argv, int rank, Halo3dPacking *packing); // Parses the options; returns -1 if invalid.
+void initialiseGrid(float *grid, int rank);								 // Fills the initial grid.
+void displayGrid(float *grid, int rank, MPI_Comm comm);					 // Displays the current grid.
+
+// As in 2D the indexing is performed 'by hand.' Planes, rows and columns 1 to local_L[] are the local grid,
+// with the ghost cells at 0 and local_L[]+1.
+static inline size_t _index(int plane, int row, int col) { return plane * planeStride + row * rowStride + col; }
+
+// The 7-point stencil along part of one row: updates n cells from dest[0], reading the same cells of the old
+// grid from src[0], and returns the largest change to any of them. As for stencilRow() in heatEqn.c, the
+// grids never overlap and the maximum is taken with a comparison, so the loop vectorises.
+static inline float stencilRow(float *restrict dest, const float *restrict src, int n)
+{
+	int i;
+	float change = 0.0f;
+	size_t rs = rowStride, ps = planeStride;
+#pragma omp simd reduction(max : change)
+	for (i = 0; i < n; i++)
+	{
+		dest[i] = (1.0f / 6.0f) * (src[i + ps] + src[i - ps] + src[i + rs] + src[i - rs] + src[i + 1] + src[i - 1]);
+		float diff = fabsf(dest[i] - src[i]);
+		change = (diff > change ? diff : change);
+	}
+	return change;
+}
+
+//
+// Main.
+//
+int main(int argc, char **argv)
+{
+	//
+	// Initialisation.
+	//
+
+	// Initialise MPI and get the rank and total number of processes. Only the master thread makes
+	// MPI calls, outside of the OpenMP parallel regions, so MPI_THREAD_FUNNELED is sufficient.
+	int rank, numProcs, provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	MPI_Comm_size(MPI_COMM_WORLD, &numProcs);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+	// Check the MPI library can be used alongside OpenMP threads.
+	if (provided < MPI_THREAD_FUNNELED)
+	{
+		if (rank == 0)
+			printf("The MPI library does not support MPI_THREAD_FUNNELED.\n");
+		MPI_Finalize();
+		return EXIT_FAILURE;
+	}
+
+	// Parse the command line options.
+	Halo3dPacking packing;
+	if (parseCommandLine(argc, argv, rank, &packing) == -1)
+	{
+		MPI_Finalize();
+		return EXIT_FAILURE;
+	}
+
+	// Arrange the processes in a 3D grid, with the number in each direction non-increasing, i.e. the fewest
+	// across columns. Each direction must divide the global grid size.
+	int i, dims[3] = {0, 0, 0}, periods[3] = {0, 0, 0};
+	MPI_Dims_create(numProcs, 3, dims);
+	if (L % dims[0] || L % dims[1] || L % dims[2])
+	{
+		if (rank == 0)
+			printf("Grid dimension %d needs to be a multiple of the number of processes in each direction (%d x %d x %d).\n", L, dims[0], dims[1], dims[2]);
+		MPI_Finalize();
+		return EXIT_FAILURE;
+	}
+
+	// Ranks are not reordered, so the block with coordinates (c0,c1,c2) is owned by rank (c0*dims[1]+c1)*dims[2]+c2.
+	MPI_Comm gridComm;
+	MPI_Cart_create(MPI_COMM_WORLD, 3, dims, periods, 0, &gridComm);
+
+	// Two grids, for the Jacobi iteration, each with its own exchange.
+	for (i = 0; i < 3; i++)
+		local_L[i] = L / dims[i];
+	Halo3dExchange halo[2];
+	for (i = 0; i < 2; i++)
+		halo3dCreate(&halo[i], packing, gridComm, local_L);
+	rowStride = halo[0].rowStride;
+	planeStride = halo[0].planeStride;
+
+	// Fill in the original grid. Both grids are filled, so both have the (zero) boundary conditions.
+	for (i = 0; i < 2; i++)
+		initialiseGrid(halo[i].grid, rank);
+
+	// Display the initial grid.
+	if (rank == 0)
+		printf("Initial grid (%d x %d x %d processes):\n", dims[0], dims[1], dims[2]);
+	displayGrid(halo[0].grid, rank, gridComm);
+
+	// Start the timer.
+	double startTime = MPI_Wtime();
+
+	//
+	// Iteration.
+	//
+	int iter, current = 0, converged = 0, np = local_L[0], nr = local_L[1], nc = local_L[2];
+	float maxChange = 0.0f, reduceChange;
+	MPI_Request reduceRequest = MPI_REQUEST_NULL;
+	for (iter = 0; iter < numIterations && !converged; iter++)
+	{
+		float localChange = 0.0f, *oldGrid = halo[current].grid, *newGrid = halo[1 - current].grid;
+		int plane, row;
+
+		// Start synchronising the ghost cells, which only reads the face cells of the old grid.
+		halo3dStart(&halo[current]);
+
+		// Update the interior cells, which do not read the ghost cells, while the exchange proceeds. The rows
+		// of all planes are shared between threads with the same static schedule as in initialiseGrid().
+#pragma omp parallel for collapse(2) reduction(max : localChange) schedule(static)
+		for (plane = 2; plane < np; plane++)
+			for (row = 2; row < nr; row++)
+				localChange = fmaxf(localChange, stencilRow(&newGrid[_index(plane, row, 2)], &oldGrid[_index(plane, row, 2)], nc - 2));
+
+		halo3dFinish(&halo[current]);
+
+		// Now the face cells: whole rows in the first and last planes, and the first and last rows of the
+		// others, and just the first and last columns in between.
+#pragma omp parallel for collapse(2) reduction(max : localChange) schedule(static)
+		for (plane = 1; plane < np + 1; plane++)
+			for (row = 1; row < nr + 1; row++)
+				if (plane == 1 || plane == np || row == 1 || row == nr)
+					localChange = fmaxf(localChange, stencilRow(&newGrid[_index(plane, row, 1)], &oldGrid[_index(plane, row, 1)], nc));
+				else
+				{
+					localChange = fmaxf(localChange, stencilRow(&newGrid[_index(plane, row, 1)], &oldGrid[_index(plane, row, 1)], 1));
+					localChange = fmaxf(localChange, stencilRow(&newGrid[_index(plane, row, nc)], &oldGrid[_index(plane, row, nc)], 1));
+				}
+
+		// The new grid becomes the current one.
+		current = 1 - current;
+
+		// Test for convergence as in heatEqn.c, with the global maximum overlapped with the next iteration.
+		if (reduceRequest != MPI_REQUEST_NULL)
+		{
+			MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE);
+			converged = (maxChange <= tolerance);
+		}
+		if (tolerance > 0.0f && !converged && (iter + 1) % checkInterval == 0)
+		{
+			reduceChange = localChange;
+			MPI_Iallreduce(&reduceChange, &maxChange, 1, MPI_FLOAT, MPI_MAX, gridComm, &reduceRequest);
+		}
+	}
+
+	// A reduction may still be in progress if the maximum number of iterations was reached.
+	if (reduceRequest != MPI_REQUEST_NULL)
+	{
+		MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE);
+		converged = (maxChange <= tolerance);
+	}
+
+	// Calculate how long the calculation took.
+	double endTime = MPI_Wtime();
+
+	// Display the final grid and the time taken.
+	if (rank == 0)
+		printf("\nFinal grid:\n");
+	displayGrid(halo[current].grid, rank, gridComm);
+	int numThreads = 1;
+#ifdef _OPENMP
+	numThreads = omp_get_max_threads();
+#endif
+	if (rank == 0)
+	{
+		if (tolerance > 0.0f)
+			printf("\n%s after %d iterations; largest change when last checked %g.\n", converged ? "Converged" : "Not converged", iter, maxChange);
+		printf("\nTime taken: %g s (%d x %d x %d processes, column faces %s, %d thread(s) per process).\n", endTime - startTime, dims[0], dims[1], dims[2], halo3dPackingNames[packing], numThreads);
+	}
+
+	//
+	// Clear up and quit.
+	//
+	for (i = 0; i < 2; i++)
+		halo3dFree(&halo[i]); // Also frees the grids.
+	MPI_Comm_free(&gridComm);
+	MPI_Finalize();
+	return EXIT_SUCCESS;
+}
+
+//
+// Functions.
+//
+
+// Parses the command line options, all of which are optional:
+//
+// -L <size>          : the global grid size L (default 8).
+// -iterations <n>    : the (maximum) number of iterations (default 10).
+// -tolerance <tol>   : stop once no cell changes by more than this in an iteration (default 0, i.e. never).
+// -checkInterval <n> : test for convergence every n iterations (default 10).
+// -pack <name>       : how to send the faces between columns; one of the names in halo3dPackingNames[] (default 'packed').
+//
+// Only rank 0 prints error messages, but all ranks return -1 if the options are invalid.
+int parseCommandLine(int argc, char **argv, int rank, Halo3dPacking *packing)
+{
+	int i, b;
+
+	*packing = HALO3D_PACKED;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-L") && i + 1 < argc)
+		{
+			if ((L = atoi(argv[++i])) <= 0)
+			{
+				if (rank == 0)
+					printf("Error: The grid size L must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc)
+		{
+			if ((numIterations = atoi(argv[++i])) < 0)
+			{
+				if (rank == 0)
+					printf("Error: The number of iterations cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-tolerance") && i + 1 < argc)
+		{
+			if ((tolerance = atof(argv[++i])) < 0.0f)
+			{
+				if (rank == 0)
+					printf("Error: The tolerance cannot be negative.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-checkInterval") && i + 1 < argc)
+		{
+			if ((checkInterval = atoi(argv[++i])) <= 0)
+			{
+				if (rank == 0)
+					printf("Error: The convergence check interval must be positive.\n");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-pack") && i + 1 < argc)
+		{
+			if ((b = halo3dPackingFromName(argv[++i])) == -1)
+			{
+				if (rank == 0)
+					printf("Error: Unknown packing '%s'.\n", argv[i]);
+				return -1;
+			}
+			*packing = b;
+		}
+		else
+		{
+			if (rank == 0)
+			{
+				printf("Call as\n\nmpiexec -n <p> ./heatEqn3d [-L <size>] [-iterations <n>] [-tolerance <tol>] [-checkInterval <n>] [-pack <packing>]\n\nwhere <packing> is one of:");
+				for (b = 0; b < HALO3D_NUM_PACKINGS; b++)
+					printf(" %s", halo3dPackingNames[b]);
+				printf("\n");
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Initialise the local grid for this process.
+void initialiseGrid(float *grid, int rank)
+{
+	int i, j, k;
+
+	// Set all nodes to zero, i.e. the boundary condition, using the same static schedule over the rows
+	// of all planes as the iterations, so each thread's rows are placed in memory local to that thread.
+#pragma omp parallel for collapse(2) private(k) schedule(static)
+	for (i = 0; i < local_L[0] + 2; i++)
+		for (j = 0; j < local_L[1] + 2; j++)
+			for (k = 0; k < (int)rowStride; k++)
+				grid[_index(i, j, k)] = 0.0f;
+
+	// Now overwrite the internal nodes with some values.
+#pragma omp parallel for collapse(2) private(k) schedule(static)
+	for (i = 1; i < local_L[0] + 1; i++)
+		for (j = 1; j < local_L[1] + 1; j++)
+			for (k = 1; k < local_L[2] + 1; k++)
+				grid[_index(i, j, k)] = rank + 1;
+}
+
+// Displays the current grid, one plane after another (excluding the boundary). Each process sends its whole
+// block to rank 0 in one message, which rank 0 copies into place in a global array and then prints.
+void displayGrid(float *grid, int rank, MPI_Comm comm)
+{
+	int numProcs, source, i, j, k, coords[3];
+	size_t count = (size_t)local_L[0] * local_L[1] * local_L[2];
+
+	// Only display if small enough.
+	if (L > MAX_DISPLAY_L)
+	{
+		if (rank == 0)
+			printf("Not displaying grid; too big.\n");
+		return;
+	}
+
+	// Copy the local block without the ghost cells and padding.
+	float *block = (float *)malloc(count * sizeof(float));
+	for (i = 0; i < local_L[0]; i++)
+		for (j = 0; j < local_L[1]; j++)
+			memcpy(&block[((size_t)i * local_L[1] + j) * local_L[2]], &grid[_index(i + 1, j + 1, 1)], local_L[2] * sizeof(float));
+
+	if (rank != 0)
+		MPI_Send(block, count, MPI_FLOAT, 0, 0, comm);
+	else
+	{
+		float *global = (float *)malloc((size_t)L * L * L * sizeof(float));
+		MPI_Comm_size(comm, &numProcs);
+		for (source = 0; source < numProcs; source++)
+		{
+			if (source != 0)
+				MPI_Recv(block, count, MPI_FLOAT, source, 0, comm, MPI_STATUS_IGNORE);
+			MPI_Cart_coords(comm, source, 3, coords);
+			for (i = 0; i < local_L[0]; i++)
+				for (j = 0; j < local_L[1]; j++)
+					for (k = 0; k < local_L[2]; k++)
+						global[((size_t)(coords[0] * local_L[0] + i) * L + coords[1] * local_L[1] + j) * L + coords[2] * local_L[2] + k] = block[((size_t)i * local_L[1] + j) * local_L[2] + k];
+		}
+
+		for (i = 0; i < L; i++)
+		{
+			printf("Plane %d:\n", i + 1);
+			for (j = 0; j < L; j++)
+			{
+				for (k = 0; k < L; k++)
+					printf("%6.3f ", global[((size_t)i * L + j) * L + k]);
+				printf("\n");
+			}
+		}
+		free(global);
+	}
+
+	free(block);
+}
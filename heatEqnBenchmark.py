@@ -0,0 +1,107 @@
+#
+# Strong- and weak-scaling benchmark for heatEqn.c; run with 'make benchmark' (see the makefile), or e.g.
+#
+# python3 heatEqnBenchmark.py -ranks 1 4 9 16 -L 720 1440 -local 128 256 -halo persistent neighbour -threads 1 2
+#
+# For every combination of halo exchange backend, number of threads per process and grid size, runs heatEqn
+# over each number of processes (which must be square numbers), several times, and tabulates the mean time and
+# the parallel speed-up and efficiency relative to the fewest processes:
+#
+# - Strong scaling keeps the global grid size fixed at each -L, which every number of processes per side must divide.
+#   The speed-up is S = T(base) / T(p), and the efficiency E = S * base / p.
+# - Weak scaling keeps the local grid size fixed at each -local, i.e. L = sqrt(p) * local, so the efficiency is
+#   E = T(base) / T(p) (the speed-up is S = E * p / base, i.e. how much more work is done in the same time).
+#
+# The time is that output by the code, i.e. the iterations only, as in the coursework tables. The fraction of
+# that time spent waiting for the halo exchange (the mean across processes, from heatEqn's -profile) is also
+# given, to tell whether any loss of efficiency is down to communication.
+#
+# The tables are printed and also written to <output>.txt, with every run in <output>.csv.
+#
+import argparse, csv, math, os, re, subprocess, sys, tempfile
+
+# Parse the command line.
+parser = argparse.ArgumentParser(description="Strong- and weak-scaling benchmark for heatEqn.")
+parser.add_argument("-exe", default="./heatEqn", help="the heatEqn executable (default ./heatEqn)")
+parser.add_argument("-mpiexec", default="mpiexec", help="the MPI launcher, with any options (default mpiexec)")
+parser.add_argument("-ranks", type=int, nargs="+", default=[1, 4, 9, 16], help="the numbers of processes (square numbers)")
+parser.add_argument("-threads", type=int, nargs="+", default=[1], help="the numbers of OpenMP threads per process")
+parser.add_argument("-halo", nargs="+", default=["persistent"], help="the halo exchange backends")
+parser.add_argument("-mode", choices=["strong", "weak", "both"], default="both", help="which scaling study to run")
+parser.add_argument("-L", type=int, nargs="+", default=[1440], help="the global grid sizes for strong scaling")
+parser.add_argument("-local", type=int, nargs="+", default=[256], help="the local grid sizes for weak scaling")
+parser.add_argument("-iterations", type=int, default=1000, help="the number of iterations of each run")
+parser.add_argument("-repeats", type=int, default=3, help="the number of runs to average over")
+parser.add_argument("-options", default="", help="any other options for heatEqn, e.g. '-solver sor'")
+parser.add_argument("-output", default="heatEqnBenchmark", help="the start of the names of the output files")
+args = parser.parse_args()
+
+for p in args.ranks:
+	if math.isqrt(p) ** 2 != p:
+		sys.exit("The number of processes %d is not a square number." % p)
+
+# Runs heatEqn once, and returns the time taken and the mean fraction of it spent waiting for the halo exchange.
+def run(ranks, threads, halo, L):
+	with tempfile.TemporaryDirectory() as tmp:
+		profile = os.path.join(tmp, "profile.csv")
+		command = args.mpiexec.split() + ["-n", str(ranks), args.exe, "-L", str(L), "-iterations", str(args.iterations),
+			"-halo", halo, "-profile", profile, "-profileFormat", "csv"] + args.options.split()
+		result = subprocess.run(command, env=dict(os.environ, OMP_NUM_THREADS=str(threads)), capture_output=True, text=True)
+		match = re.search(r"Time taken: (\S+) s", result.stdout)
+		if result.returncode != 0 or not match:
+			sys.exit("Failed: %s\n%s%s" % (" ".join(command), result.stdout, result.stderr))
+
+		# The 'mean' row of the profile, whose columns include 'wait' and 'total'.
+		mean = [row for row in csv.DictReader(open(profile)) if row["rank"] == "mean"][0]
+		return float(match.group(1)), float(mean["wait"]) / float(mean["total"])
+
+# Runs one scaling study for one backend and number of threads, for each grid size (global for strong scaling,
+# local for weak), and returns the size and rows of each.
+def study(mode, halo, threads):
+	studies = []
+	for size in (args.L if mode == "strong" else args.local):
+		rows = []
+		for p in sorted(args.ranks):
+			L = (size if mode == "strong" else math.isqrt(p) * size)
+			if L % math.isqrt(p):
+				print("Skipping %d processes for strong scaling, as %d processes per side do not divide L=%d." % (p, math.isqrt(p), L))
+				continue
+
+			runs = [run(p, threads, halo, L) for repeat in range(args.repeats)]
+			time = sum(t for t, wait in runs) / len(runs)
+			wait = sum(wait for t, wait in runs) / len(runs)
+			for t, w in runs:
+				writer.writerow([mode, halo, threads, p, L, t, w])
+
+			# Relative to the first (i.e. fewest) number of processes.
+			base, baseTime = (rows[0][0], rows[0][2]) if rows else (p, time)
+			if mode == "strong":
+				speedUp = baseTime / time
+				efficiency = speedUp * base / p
+			else:
+				efficiency = baseTime / time
+				speedUp = efficiency * p / base
+			rows.append((p, L, time, speedUp, efficiency, wait))
+		studies.append((size, rows))
+	return studies
+
+# Writes a table in the layout of the coursework readme files.
+def table(out, mode, halo, threads, size, rows):
+	grid = ("L=%d" % size if mode == "strong" else "%d x %d per process" % (size, size))
+	out.write("\n%s scaling, %s, halo exchange %s, %d thread(s) per process, %d iterations%s:\n\n" % (mode.capitalize(), grid, halo, threads, args.iterations, (" (" + args.options + ")" if args.options else "")))
+	out.write("%-16s%-10s%-36s%-24s%-16s%s\n" % ("No. Process:", "L:", "Mean time (average of %d runs)" % args.repeats, "Parallel speed-up, S:", "Efficiency:", "Halo wait:"))
+	out.write("%-16s%-10s%-36s%-24s%-16s%s\n" % ("===========", "==", "============================", "====================", "==========", "=========="))
+	for p, L, time, speedUp, efficiency, wait in rows:
+		out.write("%-16d%-10d%-36.6g%-24.2f%-16.2f%.0f%%\n" % (p, L, time, speedUp, efficiency, 100 * wait))
+	out.flush()
+
+modes = (["strong", "weak"] if args.mode == "both" else [args.mode])
+with open(args.output + ".csv", "w", newline="") as runsFile, open(args.output + ".txt", "w") as tableFile:
+	writer = csv.writer(runsFile)
+	writer.writerow(["mode", "halo", "threads", "ranks", "L", "time", "wait fraction"])
+	for mode in modes:
+		for halo in args.halo:
+			for threads in args.threads:
+				for size, rows in study(mode, halo, threads):
+					for out in (sys.stdout, tableFile):
+						table(out, mode, halo, threads, size, rows)
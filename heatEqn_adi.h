@@ -0,0 +1,362 @@
+//
+// Implicit time stepping of the transient heat equation in heatEqn.c by the alternating direction implicit
+// (ADI) method of Peaceman and Rachford, with the same diffusivity and source as the explicit scheme in
+// heatEqn_diffusion.h, which must be included first (after heatEqn_halo.h).
+//
+// Usage:
+//
+// adiCreate( &adi, comm, &diff, rows, cols, ghost, stride );		// Once. 'diff' must outlive it.
+// change = adiStep( &adi, &halo, &other );							// Each time step; updates halo.grid in place.
+// adiFree  ( &adi );												// Once.
+//
+// Each step is two half steps, each implicit in one direction and explicit in the other:
+//
+// (I - dt/2 Ax) u* = (I + dt/2 Ay) u + dt/2 q,   then   (I - dt/2 Ay) u' = (I + dt/2 Ax) u* + dt/2 q,
+//
+// where Ax and Ay are the diffusion terms along the rows and columns (with the same face diffusivities as the
+// explicit scheme). This is stable for any dt, and second order accurate in time. The intermediate u* is kept
+// in the other grid of the Jacobi solver, with its own ghost-cell exchange.
+//
+// Each half step solves a tridiagonal system along every row (or column) of the global grid, which is split
+// between the p processes of its row (or column) of blocks. They are solved by the partition method: each
+// process solves its segment of every line as if the cells either side were zero (y), and for the influence
+// of each of those two cells (v and w), so that x = y + v x_left + w x_right. The first and last of y, v and
+// w of every line are gathered onto every process of the row of blocks, which then solves the resulting
+// (block tridiagonal, 2x2 blocks) system for the cells either side of each segment, and only needs the two next
+// to its own. The reduced systems (of size 2p) are cheap to solve redundantly, so each half step only
+// exchanges a few numbers per line with one MPI_Allgather, rather than moving the whole grid as a transpose would.
+//
+// The matrices only depend on the diffusivity, so their factorisations, and v and w, are worked out once, and
+// each half step only solves for y: one pass down each segment and one back up, with no divisions. That costs
+// nine more arrays the size of the grid. The rows are contiguous, so are solved one at a time; the columns are
+// solved ADI_CHUNK at a time, moving down all of them together, so that the inner loop runs along the rows in
+// memory (and vectorises), and the chunk stays in cache between the two passes.
+//
+
+#define ADI_CHUNK 256 // The number of columns solved together.
+
+typedef struct
+{
+	int rows, cols, ghost;		// Size of the local grid, and the layers of ghost cells.
+	size_t stride;				// The distance between rows.
+	const Diffusion *diff;		// k = D dt / (2 dx^2), and dt q, for every cell.
+	MPI_Comm lineComm[2];		// The processes sharing the rows, and the columns, of this block.
+	int lineRank[2], lineSize[2]; // This process's rank in each, and their sizes.
+	float *m[2], *cp[2];		// The factorisation along the rows and columns: 1/pivot, and the modified upper diagonal.
+	float *v[2], *w[2];			// The influence of the cells before and after each segment.
+	float *y;					// The solution with those cells zero.
+	double *ends[2];			// The first and last of v and w (four numbers), for each line of every segment.
+	double *yEnds, *yAll;		// The first and last of y for each line, of this segment and then of every segment.
+	double *neighbours;			// The solved cells either side of this segment, for each line.
+} ADI;
+
+//
+// Allocates one array laid out like the grid.
+//
+float *adiAllocate(ADI *adi, MPI_Comm comm)
+{
+	float *a = NULL;
+	MPI_Aint bytes = (MPI_Aint)(adi->rows + 2 * adi->ghost) * adi->stride * sizeof(float);
+	if (posix_memalign((void **)&a, HALO_ALIGNMENT, bytes))
+		haloAllocateFail(comm, bytes);
+	return a;
+}
+
+//
+// The lines solved along in direction 'dir' (0 for the rows, 1 for the columns): how many there are, their
+// length n, the steps between them and between the cells along them, and the index of the first cell.
+//
+void adiLines(const ADI *adi, int dir, int *numLines, int *n, size_t *lineStep, size_t *elemStep, size_t *first)
+{
+	*numLines = (dir ? adi->cols : adi->rows);
+	*n = (dir ? adi->rows : adi->cols);
+	*lineStep = (dir ? 1 : adi->stride);
+	*elemStep = (dir ? adi->stride : 1);
+	*first = adi->ghost * adi->stride + adi->ghost;
+}
+
+//
+// Factorises the tridiagonal matrices along direction 'dir', (I - dt/2 A), whose row for cell j has a x_{j-1} +
+// b x_j + c x_{j+1}, and solves for v and w. These are then gathered from every process of the row (or column)
+// of blocks. Collective over it.
+//
+void adiFactor(ADI *adi, int dir)
+{
+	int numLines, n, chunk, line;
+	size_t lineStep, elemStep, first;
+	const float *k = adi->diff->coef;
+	float *m = adi->m[dir], *cp = adi->cp[dir], *v = adi->v[dir], *w = adi->w[dir];
+
+	adiLines(adi, dir, &numLines, &n, &lineStep, &elemStep, &first);
+
+#pragma omp parallel for schedule(static)
+	for (chunk = 0; chunk < numLines; chunk += ADI_CHUNK)
+	{
+		int j, l, end = (chunk + ADI_CHUNK < numLines ? chunk + ADI_CHUNK : numLines);
+
+		// Forward elimination. v is driven by the cell before the segment (through a in its first equation), and
+		// w by the one after it (through c in its last).
+		for (j = 0; j < n; j++)
+			for (l = chunk; l < end; l++)
+			{
+				size_t i = first + l * lineStep + j * elemStep;
+				float a = -0.5f * (k[i] + k[i - elemStep]), c = -0.5f * (k[i] + k[i + elemStep]), b = 1.0f - a - c;
+				m[i] = 1.0f / (j > 0 ? b - a * cp[i - elemStep] : b);
+				cp[i] = c * m[i];
+				v[i] = -a * (j > 0 ? v[i - elemStep] : 1.0f) * m[i];
+				w[i] = (j == n - 1 ? -c * m[i] : 0.0f);
+			}
+
+		// Back substitution.
+		for (j = n - 2; j >= 0; j--)
+			for (l = chunk; l < end; l++)
+			{
+				size_t i = first + l * lineStep + j * elemStep;
+				v[i] -= cp[i] * v[i + elemStep];
+				w[i] -= cp[i] * w[i + elemStep];
+			}
+	}
+
+	double *local = (double *)malloc((size_t)4 * numLines * sizeof(double));
+	for (line = 0; line < numLines; line++)
+	{
+		size_t i0 = first + line * lineStep, i1 = i0 + (n - 1) * elemStep;
+		local[4 * line + 0] = v[i0], local[4 * line + 1] = w[i0];
+		local[4 * line + 2] = v[i1], local[4 * line + 3] = w[i1];
+	}
+	adi->ends[dir] = (double *)malloc((size_t)4 * numLines * adi->lineSize[dir] * sizeof(double));
+	MPI_Allgather(local, 4 * numLines, MPI_DOUBLE, adi->ends[dir], 4 * numLines, MPI_DOUBLE, adi->lineComm[dir]);
+	free(local);
+}
+
+//
+// Prepares for time steps of a rows*cols local grid, with 'ghost' layers of ghost cells and rows 'stride' floats
+// apart, of the grid distributed over the 2D Cartesian communicator comm, with the coefficients in 'diff'.
+//
+void adiCreate(ADI *adi, MPI_Comm comm, const Diffusion *diff, int rows, int cols, int ghost, size_t stride)
+{
+	int dir, longest = (rows > cols ? rows : cols);
+
+	adi->rows = rows;
+	adi->cols = cols;
+	adi->ghost = ghost;
+	adi->stride = stride;
+	adi->diff = diff;
+	adi->y = adiAllocate(adi, comm);
+
+	// The rows of the global grid run across the block columns, i.e. dimension 1 of comm, and the columns down
+	// the block rows, dimension 0.
+	for (dir = 0; dir < 2; dir++)
+	{
+		int remain[2] = {dir, 1 - dir};
+		MPI_Cart_sub(comm, remain, &adi->lineComm[dir]);
+		MPI_Comm_rank(adi->lineComm[dir], &adi->lineRank[dir]);
+		MPI_Comm_size(adi->lineComm[dir], &adi->lineSize[dir]);
+
+		adi->m[dir] = adiAllocate(adi, comm);
+		adi->cp[dir] = adiAllocate(adi, comm);
+		adi->v[dir] = adiAllocate(adi, comm);
+		adi->w[dir] = adiAllocate(adi, comm);
+		adiFactor(adi, dir);
+	}
+
+	int p = (adi->lineSize[0] > adi->lineSize[1] ? adi->lineSize[0] : adi->lineSize[1]);
+	adi->yEnds = (double *)malloc((size_t)2 * longest * (p + 1) * sizeof(double));
+	adi->yAll = adi->yEnds + 2 * longest;
+	adi->neighbours = (double *)malloc((size_t)2 * longest * sizeof(double));
+}
+
+//
+// Solves the reduced system for one line, from the ends of v and w (four numbers for each of the p segments,
+// 'step' apart) and of y (two, 'yStep' apart), for the cells either side of segment 'me': the last of segment
+// me-1 and the first of segment me+1 (zero at the edge of the domain). The unknowns are the first and last
+// cells of each segment, Z_s = (F_s, L_s), with F_s = y1 + v1 L_{s-1} + w1 F_{s+1} and L_s = yn + vn L_{s-1} +
+// wn F_{s+1}. That is block tridiagonal, Z_s - P_s Z_{s-1} - Q_s Z_{s+1} = Y_s, which is solved by block
+// Gaussian elimination with the 2x2 matrices C'_s and vectors Y'_s in 'work' (6p doubles).
+//
+void adiReduced(const double *ends, size_t step, const double *ys, size_t yStep, int p, int me, double *work, double *left, double *right)
+{
+	int s;
+	double *cp = work, *yp = work + 4 * p; // cp[4s..4s+3] is C'_s (row-major), yp[2s..2s+1] is Y'_s.
+
+	for (s = 0; s < p; s++)
+	{
+		const double *e = &ends[s * step], *y = &ys[s * yStep]; // v1, w1, vn, wn; and y1, yn.
+
+		// Eliminating Z_{s-1}: with A_s = -P_s = [[0,-v1],[0,-vn]], the diagonal block becomes I - A_s C'_{s-1},
+		// and the right hand side Y_s - A_s Y'_{s-1}. Only the second column of A_s is non-zero.
+		double d00 = 1.0, d01 = 0.0, d10 = 0.0, d11 = 1.0, r0 = y[0], r1 = y[1];
+		if (s > 0)
+		{
+			const double *c = &cp[4 * (s - 1)], *yPrev = &yp[2 * (s - 1)];
+			d00 += e[0] * c[2];
+			d01 += e[0] * c[3];
+			d10 += e[2] * c[2];
+			d11 += e[2] * c[3];
+			r0 += e[0] * yPrev[1];
+			r1 += e[2] * yPrev[1];
+		}
+
+		// C'_s = D^-1 C_s, with C_s = -Q_s = [[-w1,0],[-wn,0]], and Y'_s = D^-1 r.
+		double det = d00 * d11 - d01 * d10;
+		cp[4 * s + 0] = (d01 * e[3] - d11 * e[1]) / det;
+		cp[4 * s + 1] = 0.0;
+		cp[4 * s + 2] = (d10 * e[1] - d00 * e[3]) / det;
+		cp[4 * s + 3] = 0.0;
+		yp[2 * s + 0] = (d11 * r0 - d01 * r1) / det;
+		yp[2 * s + 1] = (d00 * r1 - d10 * r0) / det;
+	}
+
+	// Back substitution, Z_s = Y'_s - C'_s Z_{s+1}, in place in yp, down to the segment before this one. Only
+	// the first column of C'_s is non-zero.
+	for (s = p - 2; s >= (me > 0 ? me - 1 : 0); s--)
+	{
+		yp[2 * s + 0] -= cp[4 * s + 0] * yp[2 * (s + 1)];
+		yp[2 * s + 1] -= cp[4 * s + 2] * yp[2 * (s + 1)];
+	}
+
+	*left = (me > 0 ? yp[2 * (me - 1) + 1] : 0.0);
+	*right = (me < p - 1 ? yp[2 * (me + 1)] : 0.0);
+}
+
+//
+// One half step, implicit along the rows (dir 0) or columns (dir 1): reads the grid src, whose ghost cells
+// must be up to date, and writes dest. Returns the largest change from the previous contents of dest.
+//
+float adiSweep(ADI *adi, int dir, float *dest, const float *src)
+{
+	int numLines, n, chunk, line, row, p = adi->lineSize[dir];
+	size_t lineStep, elemStep, first, stride = adi->stride;
+	const float *k = adi->diff->coef, *q = adi->diff->source, *m = adi->m[dir], *cp = adi->cp[dir], *v = adi->v[dir], *w = adi->w[dir];
+	float *y = adi->y, change = 0.0f;
+
+	adiLines(adi, dir, &numLines, &n, &lineStep, &elemStep, &first);
+
+	// Solve each segment for y. The right hand side is the explicit part across the line, plus half the source.
+	if (dir == 0)
+	{
+		// Each row is contiguous, so solve them one at a time: the right hand side vectorises, and the
+		// recurrences run along the row.
+#pragma omp parallel for schedule(static)
+		for (line = 0; line < numLines; line++)
+		{
+			int j;
+			size_t i0 = first + line * stride;
+			const float *kr = &k[i0], *ur = &src[i0], *qr = &q[i0], *mr = &m[i0], *cr = &cp[i0];
+			float *yr = &y[i0];
+
+#pragma omp simd
+			for (j = 0; j < n; j++)
+			{
+				float u = ur[j];
+				yr[j] = (u + 0.5f * (kr[j] + kr[j - stride]) * (ur[j - stride] - u) + 0.5f * (kr[j] + kr[j + stride]) * (ur[j + stride] - u) + 0.5f * qr[j]) * mr[j];
+			}
+			for (j = 1; j < n; j++)
+				yr[j] += 0.5f * (kr[j] + kr[j - 1]) * mr[j] * yr[j - 1];
+			for (j = n - 2; j >= 0; j--)
+				yr[j] -= cr[j] * yr[j + 1];
+		}
+	}
+	else
+	{
+		// Solve ADI_CHUNK columns together, a row at a time, which vectorises, and keeps the chunk in cache
+		// for the way back up.
+#pragma omp parallel for schedule(static)
+		for (chunk = 0; chunk < numLines; chunk += ADI_CHUNK)
+		{
+			int j, l, end = (chunk + ADI_CHUNK < numLines ? chunk + ADI_CHUNK : numLines);
+
+			for (j = 0; j < n; j++)
+#pragma omp simd
+				for (l = chunk; l < end; l++)
+				{
+					size_t i = first + j * stride + l;
+					float u = src[i];
+					float d = u + 0.5f * (k[i] + k[i - 1]) * (src[i - 1] - u) + 0.5f * (k[i] + k[i + 1]) * (src[i + 1] - u) + 0.5f * q[i];
+					y[i] = (j > 0 ? d + 0.5f * (k[i] + k[i - stride]) * y[i - stride] : d) * m[i];
+				}
+
+			for (j = n - 2; j >= 0; j--)
+#pragma omp simd
+				for (l = chunk; l < end; l++)
+				{
+					size_t i = first + j * stride + l;
+					y[i] -= cp[i] * y[i + stride];
+				}
+		}
+	}
+
+	// Every process of the row (or column) of blocks needs the ends of y for every segment of every line ...
+	for (line = 0; line < numLines; line++)
+	{
+		size_t i0 = first + line * lineStep;
+		adi->yEnds[2 * line] = y[i0];
+		adi->yEnds[2 * line + 1] = y[i0 + (n - 1) * elemStep];
+	}
+	MPI_Allgather(adi->yEnds, 2 * numLines, MPI_DOUBLE, adi->yAll, 2 * numLines, MPI_DOUBLE, adi->lineComm[dir]);
+
+	// ... to solve the reduced system of each line for the cells either side of this segment ...
+#pragma omp parallel
+	{
+		double *work = (double *)malloc(6 * p * sizeof(double));
+#pragma omp for schedule(static)
+		for (line = 0; line < numLines; line++)
+			adiReduced(&adi->ends[dir][4 * line], (size_t)4 * numLines, &adi->yAll[2 * line], (size_t)2 * numLines, p, adi->lineRank[dir], work, &adi->neighbours[2 * line], &adi->neighbours[2 * line + 1]);
+		free(work);
+	}
+
+	// ... and combine the three solutions, a row at a time in either direction. Along the rows, each row has
+	// one pair of neighbours; down the columns, each cell of a row has its own.
+#pragma omp parallel for reduction(max : change) schedule(static)
+	for (row = 0; row < adi->rows; row++)
+	{
+		int col;
+		size_t i0 = first + row * stride, step = (dir ? 2 : 0);
+		const double *nb = &adi->neighbours[dir ? 0 : 2 * row];
+#pragma omp simd reduction(max : change)
+		for (col = 0; col < adi->cols; col++)
+		{
+			float x = y[i0 + col] + v[i0 + col] * (float)nb[col * step] + w[i0 + col] * (float)nb[col * step + 1];
+			float diff = fabsf(x - dest[i0 + col]);
+			change = (diff > change ? diff : change);
+			dest[i0 + col] = x;
+		}
+	}
+
+	return change;
+}
+
+//
+// One time step, updating the grid of 'halo' in place, with the intermediate values in the grid of 'other'.
+// Returns the largest change to any cell. Collective over the communicator.
+//
+float adiStep(ADI *adi, HaloExchange *halo, HaloExchange *other)
+{
+	haloStart(halo);
+	haloFinish(halo);
+	adiSweep(adi, 0, other->grid, halo->grid);
+
+	haloStart(other);
+	haloFinish(other);
+	return adiSweep(adi, 1, halo->grid, other->grid);
+}
+
+//
+// Frees everything.
+//
+void adiFree(ADI *adi)
+{
+	int dir;
+	for (dir = 0; dir < 2; dir++)
+	{
+		MPI_Comm_free(&adi->lineComm[dir]);
+		free(adi->m[dir]);
+		free(adi->cp[dir]);
+		free(adi->v[dir]);
+		free(adi->w[dir]);
+		free(adi->ends[dir]);
+	}
+	free(adi->y);
+	free(adi->yEnds);
+	free(adi->neighbours);
+}
@@ -0,0 +1,412 @@
+//
+// Matrix-free preconditioned conjugate gradients for the steady state of the 2D heat equation in heatEqn.c,
+// i.e. the linear system Au = 0 where Au = 4u - (sum of the four neighbours), with the ghost cells at the
+// edge of the domain fixed at zero. Builds on the ghost-cell exchange in heatEqn_halo.h, which must be
+// included first.
+//
+// Usage:
+//
+// cgCreate   ( &cg, &halo, backend, comm, pipelined, preconditioner );	// Once. 'halo' holds the initial guess.
+// cgIteration( &cg );													// Each iteration; updates halo.grid in place.
+// cgFree     ( &cg );													// Once, before freeing 'halo'.
+//
+// The standard method needs two global sums per iteration, and every rank waits for each of them. The
+// pipelined variant (Ghysels and Vanroose, Parallel Computing 40, 2014) rearranges the recurrences so that
+// both sums go into one non-blocking reduction, which completes while the preconditioner and the stencil
+// (with its ghost-cell exchange) are applied. This costs more vector updates and some numerical stability,
+// so it pays off when the reductions dominate, i.e. on many ranks.
+//
+// In single precision the residual that the pipelined variant calculates by recurrence soon drifts from the
+// true one, and convergence stalls. So every CG_REPLACE_INTERVAL iterations the vectors calculated by
+// recurrence are recalculated from their definitions (Cools et al., SIAM J. Sci. Comput. 40, 2018).
+//
+// All the local vectors have the same layout as the grid, although only the vector that the stencil is
+// applied to uses its ghost cells. Dot products are accumulated in double precision.
+//
+
+#include <math.h>
+
+#define CG_REPLACE_INTERVAL 20 // Iterations between residual replacements in the pipelined variant.
+
+// The available preconditioners.
+typedef enum
+{
+	CG_NONE,
+	CG_JACOBI,	  // Divides by the diagonal. As that is constant here this only rescales, but costs next to nothing.
+	CG_BLOCK_ILU, // Incomplete LU factorisation, with no fill-in, of each rank's block; ignores the coupling
+				  // between blocks, so needs no communication. Applying it is sequential within each rank.
+	CG_NUM_PRECONDITIONERS
+} CGPreconditioner;
+
+const char *cgPreconditionerNames[CG_NUM_PRECONDITIONERS] = {"none", "jacobi", "block-ilu"};
+
+typedef struct
+{
+	int n;							 // Size of the local grid, excluding the ghost cells.
+	size_t stride;					 // The distance between rows, for every vector.
+	MPI_Comm comm;					 // Communicator for the global sums.
+	int pipelined;					 // Non-zero for the pipelined variant.
+	CGPreconditioner preconditioner; //
+	float *iluDiagonal;				 // CG_BLOCK_ILU only: the diagonal of the factorisation.
+	HaloExchange *x;				 // The solution, i.e. the caller's grid.
+	HaloExchange stencil;			 // The vector the stencil is applied to, with its exchange: p, or m when pipelined.
+	float *r, *z, *q;				 // The residual; M^-1 r and Ap (standard), or Aq and M^-1 s (pipelined).
+	float *u, *w, *nn, *s, *p;		 // Pipelined only: M^-1 r, Au, Am, and the search directions for r (s = Ap) and x.
+	double gamma, alpha;			 // (r, M^-1 r), and the step length, from the previous iteration.
+	int iteration;					 //
+} ConjugateGradient;
+
+//
+// Allocates one vector, initialised to zero.
+//
+float *cgAllocate(ConjugateGradient *cg)
+{
+	float *v = NULL;
+	MPI_Aint bytes = (MPI_Aint)(cg->n + 2) * cg->stride * sizeof(float);
+	if (posix_memalign((void **)&v, HALO_ALIGNMENT, bytes))
+		haloAllocateFail(cg->comm, bytes);
+	memset(v, 0, bytes);
+	return v;
+}
+
+//
+// Copies the interior of one vector to another.
+//
+void cgCopy(ConjugateGradient *cg, float *dest, const float *src)
+{
+	int row;
+
+	for (row = 1; row < cg->n + 1; row++)
+		memcpy(&dest[row * cg->stride + 1], &src[row * cg->stride + 1], cg->n * sizeof(float));
+}
+
+//
+// Applies the stencil to columns [c0,c1) of one row of the stencil's vector v, i.e. result = Av there.
+// Returns the local contribution to (v, Av).
+//
+static inline double cgApplyRow(ConjugateGradient *cg, float *result, int row, int c0, int c1)
+{
+	int col;
+	size_t stride = cg->stride;
+	const float *v = cg->stencil.grid + row * stride;
+	double dot = 0.0;
+
+	result += row * stride;
+
+#pragma omp simd reduction(+ : dot)
+	for (col = c0; col < c1; col++)
+	{
+		result[col] = 4.0f * v[col] - (v[col + stride] + v[col - stride] + v[col + 1] + v[col - 1]);
+		dot += (double)v[col] * result[col];
+	}
+
+	return dot;
+}
+
+//
+// result = Av for the stencil's vector v, exchanging the ghost cells of v while the interior is calculated.
+// Returns the local part of (v, Av).
+//
+double cgApply(ConjugateGradient *cg, float *result)
+{
+	int row, n = cg->n;
+	double dot = 0.0;
+
+	haloStart(&cg->stencil);
+
+#pragma omp parallel for reduction(+ : dot) schedule(static)
+	for (row = 2; row < n; row++)
+		dot += cgApplyRow(cg, result, row, 2, n);
+
+	haloFinish(&cg->stencil);
+
+#pragma omp parallel for reduction(+ : dot) schedule(static)
+	for (row = 1; row < n + 1; row++)
+		if (row == 1 || row == n)
+			dot += cgApplyRow(cg, result, row, 1, n + 1);
+		else
+			dot += cgApplyRow(cg, result, row, 1, 2) + cgApplyRow(cg, result, row, n, n + 1);
+
+	return dot;
+}
+
+//
+// z = M^-1 r, for the chosen preconditioner M. Only the interior of z is read or written.
+//
+void cgPrecondition(ConjugateGradient *cg, float *z, const float *r)
+{
+	int row, col, n = cg->n;
+	size_t stride = cg->stride;
+	const float *d = cg->iluDiagonal;
+
+	switch (cg->preconditioner)
+	{
+	case CG_JACOBI:
+#pragma omp parallel for private(col) schedule(static)
+		for (row = 1; row < n + 1; row++)
+#pragma omp simd
+			for (col = 1; col < n + 1; col++)
+				z[row * stride + col] = 0.25f * r[row * stride + col];
+		break;
+
+	case CG_BLOCK_ILU:
+		// Forward substitution with the lower factor, then backward with the upper one. The neighbouring
+		// blocks, which the factorisation leaves out, count as zero (z may be the stencil's vector, whose
+		// ghost cells hold the neighbours' values).
+		for (row = 1; row < n + 1; row++)
+			for (col = 1; col < n + 1; col++)
+			{
+				size_t i = row * stride + col;
+				z[i] = (r[i] + (col > 1 ? z[i - 1] : 0.0f) + (row > 1 ? z[i - stride] : 0.0f)) / d[i];
+			}
+		for (row = n; row > 0; row--)
+			for (col = n; col > 0; col--)
+			{
+				size_t i = row * stride + col;
+				z[i] += ((col < n ? z[i + 1] : 0.0f) + (row < n ? z[i + stride] : 0.0f)) / d[i];
+			}
+		break;
+
+	default:
+		cgCopy(cg, z, r);
+		break;
+	}
+}
+
+//
+// Returns the local part of (a, b).
+//
+double cgDot(ConjugateGradient *cg, const float *a, const float *b)
+{
+	int row, col, n = cg->n;
+	size_t stride = cg->stride;
+	double dot = 0.0;
+
+#pragma omp parallel for private(col) reduction(+ : dot) schedule(static)
+	for (row = 1; row < n + 1; row++)
+#pragma omp simd reduction(+ : dot)
+		for (col = 1; col < n + 1; col++)
+			dot += (double)a[row * stride + col] * b[row * stride + col];
+
+	return dot;
+}
+
+//
+// Calculates the residual r = -Ax and the vectors derived from it, from scratch. The search directions are
+// unchanged, so this can also be used part way through, to correct the drift of the pipelined recurrences.
+//
+void cgReplaceResidual(ConjugateGradient *cg)
+{
+	int row, col, n = cg->n;
+	size_t stride = cg->stride;
+
+	// Applying the stencil to a copy of x so as not to need x's exchange.
+	cgCopy(cg, cg->stencil.grid, cg->x->grid);
+	cgApply(cg, cg->r);
+	for (row = 1; row < n + 1; row++)
+		for (col = 1; col < n + 1; col++)
+			cg->r[row * stride + col] = -cg->r[row * stride + col];
+
+	if (cg->pipelined)
+	{
+		// u = M^-1 r and w = Au, then (once there is a search direction) s = Ap, q = M^-1 s and z = Aq.
+		cgPrecondition(cg, cg->u, cg->r);
+		cgCopy(cg, cg->stencil.grid, cg->u);
+		cgApply(cg, cg->w);
+		if (cg->iteration > 0)
+		{
+			cgCopy(cg, cg->stencil.grid, cg->p);
+			cgApply(cg, cg->s);
+			cgPrecondition(cg, cg->q, cg->s);
+			cgCopy(cg, cg->stencil.grid, cg->q);
+			cgApply(cg, cg->z);
+		}
+	}
+	else
+	{
+		// The first search direction p = M^-1 r.
+		double gamma;
+		cgPrecondition(cg, cg->z, cg->r);
+		cgCopy(cg, cg->stencil.grid, cg->z);
+		gamma = cgDot(cg, cg->r, cg->z);
+		MPI_Allreduce(&gamma, &cg->gamma, 1, MPI_DOUBLE, MPI_SUM, cg->comm);
+	}
+}
+
+//
+// Prepares to solve from the initial guess in the grid of the exchange x, whose ghost cells must be a single
+// layer deep, on the Cartesian communicator comm.
+//
+void cgCreate(ConjugateGradient *cg, HaloExchange *x, HaloBackend backend, MPI_Comm comm, int pipelined, CGPreconditioner preconditioner)
+{
+	int row, col, n = x->rows;
+	size_t stride = x->stride;
+
+	cg->n = n;
+	cg->stride = stride;
+	cg->comm = comm;
+	cg->pipelined = pipelined;
+	cg->preconditioner = preconditioner;
+	cg->x = x;
+	cg->iteration = 0;
+
+	haloCreate(&cg->stencil, backend, comm, n, n, 1);
+	memset(cg->stencil.grid, 0, (size_t)(n + 2) * stride * sizeof(float));
+	cg->r = cgAllocate(cg);
+	cg->z = cgAllocate(cg);
+	cg->q = cgAllocate(cg);
+	cg->u = cg->w = cg->nn = cg->s = cg->p = NULL;
+	if (pipelined)
+	{
+		cg->u = cgAllocate(cg);
+		cg->w = cgAllocate(cg);
+		cg->nn = cgAllocate(cg);
+		cg->s = cgAllocate(cg);
+		cg->p = cgAllocate(cg);
+	}
+
+	// The diagonal of the incomplete factorisation, one row after another.
+	cg->iluDiagonal = NULL;
+	if (preconditioner == CG_BLOCK_ILU)
+	{
+		float *d = cg->iluDiagonal = cgAllocate(cg);
+		for (row = 1; row < n + 1; row++)
+			for (col = 1; col < n + 1; col++)
+			{
+				size_t i = row * stride + col;
+				d[i] = 4.0f - (col > 1 ? 1.0f / d[i - 1] : 0.0f) - (row > 1 ? 1.0f / d[i - stride] : 0.0f);
+			}
+	}
+
+	cgReplaceResidual(cg);
+}
+
+//
+// One iteration of the standard method. Returns the largest magnitude of any local element of the residual.
+//
+float cgStandardIteration(ConjugateGradient *cg)
+{
+	int row, col, n = cg->n;
+	size_t stride = cg->stride;
+	float *x = cg->x->grid, *r = cg->r, *z = cg->z, *q = cg->q, *p = cg->stencil.grid;
+	float alpha, beta, largest = 0.0f;
+	double local, global;
+
+	// Move along p to minimise the error in the energy norm.
+	local = cgApply(cg, q);
+	MPI_Allreduce(&local, &global, 1, MPI_DOUBLE, MPI_SUM, cg->comm);
+	alpha = cg->gamma / global;
+
+#pragma omp parallel for private(col) reduction(max : largest) schedule(static)
+	for (row = 1; row < n + 1; row++)
+#pragma omp simd reduction(max : largest)
+		for (col = 1; col < n + 1; col++)
+		{
+			size_t i = row * stride + col;
+			x[i] += alpha * p[i];
+			r[i] -= alpha * q[i];
+			largest = (fabsf(r[i]) > largest ? fabsf(r[i]) : largest);
+		}
+
+	// The next search direction, conjugate to the previous ones.
+	cgPrecondition(cg, z, r);
+	local = cgDot(cg, r, z);
+	MPI_Allreduce(&local, &global, 1, MPI_DOUBLE, MPI_SUM, cg->comm);
+	beta = global / cg->gamma;
+	cg->gamma = global;
+
+#pragma omp parallel for private(col) schedule(static)
+	for (row = 1; row < n + 1; row++)
+#pragma omp simd
+		for (col = 1; col < n + 1; col++)
+			p[row * stride + col] = z[row * stride + col] + beta * p[row * stride + col];
+
+	return largest;
+}
+
+//
+// One iteration of the pipelined method. Returns the largest magnitude of any local element of the residual.
+//
+float cgPipelinedIteration(ConjugateGradient *cg)
+{
+	int row, col, n = cg->n;
+	size_t stride = cg->stride;
+	float *x = cg->x->grid, *r = cg->r, *u = cg->u, *w = cg->w, *m = cg->stencil.grid, *nn = cg->nn;
+	float *z = cg->z, *q = cg->q, *s = cg->s, *p = cg->p;
+	float alpha, beta, largest = 0.0f;
+	double local[2], global[2];
+	MPI_Request request;
+
+	// Sum gamma = (r, u) and delta = (w, u) while calculating m = M^-1 w and n = Am.
+	local[0] = cgDot(cg, r, u);
+	local[1] = cgDot(cg, w, u);
+	MPI_Iallreduce(local, global, 2, MPI_DOUBLE, MPI_SUM, cg->comm, &request);
+
+	cgPrecondition(cg, m, w);
+	cgApply(cg, nn);
+
+	MPI_Wait(&request, MPI_STATUS_IGNORE);
+	if (cg->iteration == 0)
+	{
+		beta = 0.0f;
+		alpha = global[0] / global[1];
+	}
+	else
+	{
+		beta = global[0] / cg->gamma;
+		alpha = global[0] / (global[1] - beta * global[0] / cg->alpha);
+	}
+	cg->gamma = global[0];
+	cg->alpha = alpha;
+
+	// Update the search directions, then move along them.
+#pragma omp parallel for private(col) reduction(max : largest) schedule(static)
+	for (row = 1; row < n + 1; row++)
+#pragma omp simd reduction(max : largest)
+		for (col = 1; col < n + 1; col++)
+		{
+			size_t i = row * stride + col;
+			z[i] = nn[i] + beta * z[i];
+			q[i] = m[i] + beta * q[i];
+			s[i] = w[i] + beta * s[i];
+			p[i] = u[i] + beta * p[i];
+			x[i] += alpha * p[i];
+			r[i] -= alpha * s[i];
+			u[i] -= alpha * q[i];
+			w[i] -= alpha * z[i];
+			largest = (fabsf(r[i]) > largest ? fabsf(r[i]) : largest);
+		}
+
+	return largest;
+}
+
+//
+// Performs one iteration, updating the caller's grid. Returns the largest magnitude of any local element of
+// the residual (which the pipelined variant calculates by recurrence, so may drift from the true one).
+//
+float cgIteration(ConjugateGradient *cg)
+{
+	if (cg->pipelined && cg->iteration > 0 && cg->iteration % CG_REPLACE_INTERVAL == 0)
+		cgReplaceResidual(cg);
+
+	float largest = (cg->pipelined ? cgPipelinedIteration(cg) : cgStandardIteration(cg));
+	cg->iteration++;
+	return largest;
+}
+
+//
+// Frees everything but the caller's grid.
+//
+void cgFree(ConjugateGradient *cg)
+{
+	haloFree(&cg->stencil);
+	free(cg->r);
+	free(cg->z);
+	free(cg->q);
+	free(cg->u);
+	free(cg->w);
+	free(cg->nn);
+	free(cg->s);
+	free(cg->p);
+	free(cg->iluDiagonal);
+}
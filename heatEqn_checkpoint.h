@@ -0,0 +1,190 @@
+//
+// Parallel checkpointing and restarting of the distributed grid of heatEqn.c with MPI-IO. Every rank writes
+// its own block straight into one file holding the whole grid, through a subarray file view, so nothing is
+// funnelled through rank 0 and the file does not depend on the number of processes that wrote it.
+//
+// Usage:
+//
+// checkpointCreate( &cp, name, comm, rows, cols, ghost, stride, nonblocking );	// Once; creates the file.
+// checkpointWrite ( &cp, grid, iteration );										// Every N iterations.
+// checkpointFree  ( &cp );														// Once; completes any write.
+//
+// iteration = checkpointRead( name, comm, grid, rows, cols, ghost, stride );	// To restart; -1 on failure.
+//
+// The file starts with a small header, giving the size of the grid and the number of iterations performed,
+// followed by the cells (excluding the boundary) as native floats, row by row. The header is written
+// once the cells are complete.
+//
+// With nonblocking set, the cells are copied to a buffer and written with MPI_File_iwrite_all(), which
+// completes in the background while the iterations continue; it is waited for by the next write (or
+// checkpointFree()). Otherwise MPI_File_write_all() writes straight from the grid.
+//
+
+#define CHECKPOINT_HEADER_BYTES 64 // Space reserved for the header at the start of the file.
+
+typedef struct
+{
+	MPI_Comm comm;				// 2D Cartesian communicator over the blocks.
+	MPI_File file;				// The checkpoint file, open for writing throughout.
+	int globalSizes[2];			// Size of the whole grid.
+	int rows, cols;				// Size of the local block.
+	int ghost, stride;			// The layers of ghost cells, and the distance between rows, in the local grid.
+	MPI_Datatype fileType;		// This block's cells in the file, after the header.
+	MPI_Datatype gridType;		// The same cells in the local grid, i.e. without the ghost cells or padding.
+	int nonblocking;			// Non-zero to overlap writing with the iterations.
+	float *buffer;				// Nonblocking only: a copy of the block, being written.
+	MPI_Request request;		// Nonblocking only: the write in progress.
+	int pendingIteration;		// The iteration of the cells being written, or -1 if there are none.
+} Checkpoint;
+
+//
+// Creates the datatypes describing the local block of a rows*cols grid with 'ghost' layers of ghost cells
+// and rows 'stride' floats apart, in memory and in the file. The blocks are all the same size, arranged as
+// in the 2D Cartesian communicator comm.
+//
+void checkpointTypes(MPI_Comm comm, int rows, int cols, int ghost, int stride, int *globalSizes, MPI_Datatype *fileType, MPI_Datatype *gridType)
+{
+	int dims[2], periods[2], coords[2];
+
+	MPI_Cart_get(comm, 2, dims, periods, coords);
+	globalSizes[0] = dims[0] * rows;
+	globalSizes[1] = dims[1] * cols;
+
+	int sizes[2] = {rows, cols}, fileStarts[2] = {coords[0] * rows, coords[1] * cols};
+	MPI_Type_create_subarray(2, globalSizes, sizes, fileStarts, MPI_ORDER_C, MPI_FLOAT, fileType);
+	MPI_Type_commit(fileType);
+
+	int gridSizes[2] = {rows + 2 * ghost, stride}, gridStarts[2] = {ghost, ghost};
+	MPI_Type_create_subarray(2, gridSizes, sizes, gridStarts, MPI_ORDER_C, MPI_FLOAT, gridType);
+	MPI_Type_commit(gridType);
+}
+
+//
+// Creates (or replaces) the checkpoint file 'name', for a grid laid out as for checkpointTypes().
+//
+void checkpointCreate(Checkpoint *cp, const char *name, MPI_Comm comm, int rows, int cols, int ghost, int stride, int nonblocking)
+{
+	cp->comm = comm;
+	cp->rows = rows;
+	cp->cols = cols;
+	cp->ghost = ghost;
+	cp->stride = stride;
+	cp->nonblocking = nonblocking;
+	cp->buffer = NULL;
+	cp->pendingIteration = -1;
+
+	checkpointTypes(comm, rows, cols, ghost, stride, cp->globalSizes, &cp->fileType, &cp->gridType);
+
+	if (nonblocking && !(cp->buffer = (float *)malloc((size_t)rows * cols * sizeof(float))))
+		haloAllocateFail(comm, (MPI_Aint)rows * cols * sizeof(float));
+
+	// MPI_MODE_CREATE does not truncate an existing file, so delete it first (which fails harmlessly if
+	// there is none). Only one rank deletes it, and the others wait until it has.
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	if (rank == 0)
+		MPI_File_delete(name, MPI_INFO_NULL);
+	MPI_Barrier(comm);
+	MPI_File_open(comm, name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &cp->file);
+}
+
+//
+// Completes the write in progress (if any), then writes its header.
+//
+void checkpointFinish(Checkpoint *cp)
+{
+	int rank, header[3] = {cp->globalSizes[0], cp->globalSizes[1], cp->pendingIteration};
+
+	if (cp->pendingIteration == -1)
+		return;
+
+	if (cp->nonblocking)
+		MPI_Wait(&cp->request, MPI_STATUS_IGNORE);
+
+	// Back to a view of the whole file as bytes, for the header, which only rank 0 actually writes.
+	MPI_Comm_rank(cp->comm, &rank);
+	MPI_File_set_view(cp->file, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+	MPI_File_write_at_all(cp->file, 0, header, (rank == 0 ? 3 : 0), MPI_INT, MPI_STATUS_IGNORE);
+	cp->pendingIteration = -1;
+}
+
+//
+// Writes the local grid, after 'iteration' iterations, to the file. Collective over the communicator.
+//
+void checkpointWrite(Checkpoint *cp, const float *grid, int iteration)
+{
+	int row;
+
+	// Only one write can be in progress, as the view cannot change while it is.
+	checkpointFinish(cp);
+
+	MPI_File_set_view(cp->file, CHECKPOINT_HEADER_BYTES, MPI_FLOAT, cp->fileType, "native", MPI_INFO_NULL);
+	cp->pendingIteration = iteration;
+
+	if (cp->nonblocking)
+	{
+		// The grid will have changed before the write completes, so write a copy of the block.
+		for (row = 0; row < cp->rows; row++)
+			memcpy(&cp->buffer[(size_t)row * cp->cols], &grid[(size_t)(row + cp->ghost) * cp->stride + cp->ghost], cp->cols * sizeof(float));
+		MPI_File_iwrite_all(cp->file, cp->buffer, cp->rows * cp->cols, MPI_FLOAT, &cp->request);
+	}
+	else
+	{
+		MPI_File_write_all(cp->file, grid, 1, cp->gridType, MPI_STATUS_IGNORE);
+		checkpointFinish(cp);
+	}
+}
+
+//
+// Completes any write, and closes the file.
+//
+void checkpointFree(Checkpoint *cp)
+{
+	checkpointFinish(cp);
+	MPI_File_close(&cp->file);
+	MPI_Type_free(&cp->fileType);
+	MPI_Type_free(&cp->gridType);
+	free(cp->buffer);
+}
+
+//
+// Reads the local grid, laid out as for checkpointTypes(), from the checkpoint file 'name'. Returns the number
+// of iterations performed before the checkpoint was written, or -1 (on all ranks) if the file could not be
+// opened or is for a different size of grid; rank 0 prints why.
+//
+int checkpointRead(const char *name, MPI_Comm comm, float *grid, int rows, int cols, int ghost, int stride)
+{
+	int rank, globalSizes[2], header[3];
+	MPI_Datatype fileType, gridType;
+	MPI_File file;
+
+	MPI_Comm_rank(comm, &rank);
+
+	// Errors on files are returned rather than fatal by default.
+	if (MPI_File_open(comm, name, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+	{
+		if (rank == 0)
+			printf("Could not open the checkpoint file '%s'.\n", name);
+		return -1;
+	}
+
+	checkpointTypes(comm, rows, cols, ghost, stride, globalSizes, &fileType, &gridType);
+
+	MPI_File_read_at_all(file, 0, header, 3, MPI_INT, MPI_STATUS_IGNORE);
+	if (header[0] != globalSizes[0] || header[1] != globalSizes[1] || header[2] < 0)
+	{
+		if (rank == 0)
+			printf("The checkpoint file '%s' is for a %d x %d grid, not %d x %d.\n", name, header[0], header[1], globalSizes[0], globalSizes[1]);
+		header[2] = -1;
+	}
+	else
+	{
+		MPI_File_set_view(file, CHECKPOINT_HEADER_BYTES, MPI_FLOAT, fileType, "native", MPI_INFO_NULL);
+		MPI_File_read_all(file, grid, 1, gridType, MPI_STATUS_IGNORE);
+	}
+
+	MPI_File_close(&file);
+	MPI_Type_free(&fileType);
+	MPI_Type_free(&gridType);
+	return header[2];
+}
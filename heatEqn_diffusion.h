@@ -0,0 +1,144 @@
+//
+// Explicit (forward Euler) time stepping of the transient heat equation du/dt = div(D grad u) + q for
+// heatEqn.c, with a diffusivity D and a heat source q that can vary across the domain. Uses HALO_ALIGNMENT
+// and haloAllocateFail() from heatEqn_halo.h, which must be included first.
+//
+// Usage:
+//
+// limit = diffusionLimit( field, diffusivity, contrast, dx );	// The largest stable time step.
+// diffusionCreate( &diff, comm, rows, cols, ghost, stride, L, dx, dt, field, diffusivity, contrast, source ); // Once.
+// change = diffusionRow( dest, src, &diff.coef[i], &diff.source[i], stride, n );	// As stencilRow(); each step.
+// diffusionFree  ( &diff );	// Once.
+//
+// The diffusion term is discretised conservatively: the flux through the face between two cells uses the
+// mean of their diffusivities, so no heat is created or lost where D jumps. Each step is then
+//
+// u' = u + (sum over the four neighbours n of (k + k_n)(u_n - u)) + dt q,  where k = D dt / (2 dx^2).
+//
+// This is only stable if dt <= dx^2 / (4 max D) (the CFL condition). With a uniform D and the largest stable
+// dt, it is the Jacobi iteration (up to rounding).
+//
+// k and dt q are stored for every cell, in arrays laid out like the grid. They include the ghost cells, as k
+// is needed on both sides of every face, and with -ghost the ghost cells are also updated. Both are worked out
+// from each cell's position, so need no exchange. Each step reads the grid, k and dt q, and writes the new
+// grid, in one pass; adding the source in a second pass would stream the whole grid through memory again.
+//
+// The domain is (L+1) dx square, with the boundary cells (at zero) along its edges. D is either uniform, or
+// 'contrast' times larger in alternate horizontal layers, or in a circular inclusion in the middle. The
+// source heats a square in the middle, a fifth of the domain across, at the rate q.
+//
+
+// The available diffusivity fields.
+typedef enum
+{
+	DIFFUSION_UNIFORM,	 // D everywhere.
+	DIFFUSION_LAYERS,	 // Four horizontal layers, alternately D and contrast*D.
+	DIFFUSION_INCLUSION, // contrast*D within a quarter of the domain's width of the centre, D elsewhere.
+	DIFFUSION_NUM_FIELDS
+} DiffusionField;
+
+const char *diffusionFieldNames[DIFFUSION_NUM_FIELDS] = {"uniform", "layers", "inclusion"};
+
+typedef struct
+{
+	float *coef;   // k = D dt / (2 dx^2) for every cell, laid out like the grid.
+	float *source; // dt q for every cell, likewise.
+} Diffusion;
+
+//
+// Returns the field with the given name, or -1 if there is no such field.
+//
+int diffusionFieldFromName(const char *name)
+{
+	int field;
+	for (field = 0; field < DIFFUSION_NUM_FIELDS; field++)
+		if (!strcmp(name, diffusionFieldNames[field]))
+			return field;
+
+	return -1;
+}
+
+//
+// The diffusivity at the fractional position (x,y) of the domain, from 0 to 1 across it.
+//
+double diffusionAt(DiffusionField field, double diffusivity, double contrast, double x, double y)
+{
+	if (field == DIFFUSION_LAYERS && (int)floor(4.0 * y) % 2)
+		return contrast * diffusivity;
+	if (field == DIFFUSION_INCLUSION && (x - 0.5) * (x - 0.5) + (y - 0.5) * (y - 0.5) < 0.0625)
+		return contrast * diffusivity;
+	return diffusivity;
+}
+
+//
+// The largest stable time step, dx^2 / (4 max D).
+//
+double diffusionLimit(DiffusionField field, double diffusivity, double contrast, double dx)
+{
+	double maxDiffusivity = (field == DIFFUSION_UNIFORM || contrast < 1.0 ? diffusivity : contrast * diffusivity);
+	return dx * dx / (4.0 * maxDiffusivity);
+}
+
+//
+// Works out k and dt q for the local block of a grid L cells across (excluding the boundary), with grid spacing
+// dx and time step dt, which should be no more than diffusionLimit(). The local grid is rows*cols, with 'ghost'
+// layers of ghost cells and rows 'stride' floats apart; the blocks are all the same size, arranged as in the
+// 2D Cartesian communicator comm. The source heats the middle of the domain at the rate q.
+//
+void diffusionCreate(Diffusion *diff, MPI_Comm comm, int rows, int cols, int ghost, size_t stride, int L, double dx, double dt,
+					 DiffusionField field, double diffusivity, double contrast, double q)
+{
+	int row, dims[2], periods[2], coords[2];
+	MPI_Aint bytes = (MPI_Aint)(rows + 2 * ghost) * stride * sizeof(float);
+
+	if (posix_memalign((void **)&diff->coef, HALO_ALIGNMENT, bytes) || posix_memalign((void **)&diff->source, HALO_ALIGNMENT, bytes))
+		haloAllocateFail(comm, bytes);
+
+	MPI_Cart_get(comm, 2, dims, periods, coords);
+
+	// Local row 'ghost' (the first of the block itself) is global row coords[0]*rows+1, counting the boundary
+	// as row 0. The same static schedule as the iterations places each thread's rows in its local memory.
+#pragma omp parallel for schedule(static)
+	for (row = 0; row < rows + 2 * ghost; row++)
+	{
+		int col;
+		double y = (double)(coords[0] * rows + row - ghost + 1) / (L + 1);
+		for (col = 0; col < (int)stride; col++)
+		{
+			double x = (double)(coords[1] * cols + col - ghost + 1) / (L + 1);
+			int heated = (fabs(x - 0.5) < 0.1 && fabs(y - 0.5) < 0.1);
+			diff->coef[row * stride + col] = diffusionAt(field, diffusivity, contrast, x, y) * dt / (2.0 * dx * dx);
+			diff->source[row * stride + col] = (heated ? dt * q : 0.0);
+		}
+	}
+}
+
+//
+// One forward Euler step along part of one row: updates n cells from dest[0], reading the same cells of the
+// old grid from src[0], and k and dt q from coef[0] and source[0], and returns the largest change to any of
+// them. As for the Jacobi stencil in heatEqn.c, the maximum is taken with a comparison so the loop vectorises.
+//
+static inline float diffusionRow(float *restrict dest, const float *restrict src, const float *restrict coef, const float *restrict source, size_t stride, int n)
+{
+	int i;
+	float change = 0.0f;
+#pragma omp simd reduction(max : change)
+	for (i = 0; i < n; i++)
+	{
+		float u = src[i], k = coef[i];
+		dest[i] = u + (k + coef[i - stride]) * (src[i - stride] - u) + (k + coef[i + stride]) * (src[i + stride] - u)
+				+ (k + coef[i - 1]) * (src[i - 1] - u) + (k + coef[i + 1]) * (src[i + 1] - u) + source[i];
+		float diff = fabsf(dest[i] - u);
+		change = (diff > change ? diff : change);
+	}
+	return change;
+}
+
+//
+// Frees everything.
+//
+void diffusionFree(Diffusion *diff)
+{
+	free(diff->coef);
+	free(diff->source);
+}
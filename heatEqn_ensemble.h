@@ -0,0 +1,179 @@
+//
+// Ensemble mode for heatEqn.c: runs many independent simulations (the members of the ensemble) in one MPI job,
+// each on a group of processes of its own, rather than launching each as a separate job. One process hands
+// out the members, in order, to whichever group asks next, so groups that finish early (e.g. as their member
+// converged sooner) simply run more members.
+//
+// Usage:
+//
+// status = ensembleServe( comm, name, groupSize );	// On rank 0 of comm only; returns once every member has run.
+// ensembleCreate( &ens, comm, groupComm );		// On every other rank, once; groupComm is its group.
+// while (ensembleNext( &ens, results ) != -1)	// The results of the previous member; returns the next one.
+//     ... run member ens.member, with the options in ens.options, on groupComm, filling in results ...
+//
+// The file 'name' has one member per line, given by its options (in addition to those on the command line).
+// Blank lines and lines starting with '#' are skipped. The groups are ranks 1 to groupSize of comm, then the
+// next groupSize ranks, and so on; only the first rank of each group talks to rank 0, and passes the options
+// on to the rest of its group. Rank 0 prints the results of every member once they have all run.
+//
+
+#define ENSEMBLE_LINE_MAX 1024 // The longest line of options for one member, including the newline.
+#define ENSEMBLE_TAG_RESULT 1  // Results (and requests for another member), from the first rank of a group.
+#define ENSEMBLE_TAG_MEMBER 2  // The next member and the length of its options, then the options.
+
+// The results of running a member, as reported back to rank 0.
+typedef enum
+{
+	ENSEMBLE_FAILED,	 // Non-zero if the options were invalid, or the member could not run on its group.
+	ENSEMBLE_ITERATIONS, // The number of iterations performed.
+	ENSEMBLE_CONVERGED,	 // Non-zero if it converged (only with a tolerance).
+	ENSEMBLE_CHANGE,	 // The largest change to any cell when last checked (only with a tolerance).
+	ENSEMBLE_MEAN,		 // The mean value of the cells of the final grid.
+	ENSEMBLE_TIME,		 // The time taken by the iterations.
+	ENSEMBLE_NUM_RESULTS
+} EnsembleResult;
+
+const char *ensembleResultNames[ENSEMBLE_NUM_RESULTS] = {"Failed", "Iterations", "Converged", "Change", "Mean", "Time (s)"};
+
+typedef struct
+{
+	MPI_Comm comm;					// The communicator over every process, including rank 0.
+	MPI_Comm groupComm;				// This process's group.
+	int groupRank;					// This process's rank in its group.
+	int member;						// The member being run, or -1 before the first.
+	char options[ENSEMBLE_LINE_MAX]; // Its options.
+} Ensemble;
+
+//
+// Reads the members from the file 'name', and hands them out to the groups of groupSize processes that make up
+// the rest of comm as they ask for them, until there are none left. Then prints every member's results. If
+// the file cannot be opened, rank 0 says so, and there are no members. Call on rank 0 of comm only. Returns
+// -1 if the file could not be opened, and 0 otherwise.
+//
+int ensembleServe(MPI_Comm comm, const char *name, int groupSize)
+{
+	int numProcs, i, numMembers = 0, capacity = 0, next = 0, numGroups, active;
+	char line[ENSEMBLE_LINE_MAX], **members = NULL;
+	double request[1 + ENSEMBLE_NUM_RESULTS], *results, busy = 0.0, startTime = MPI_Wtime();
+	int *groups;
+	MPI_Status status;
+
+	MPI_Comm_size(comm, &numProcs);
+	numGroups = active = (numProcs - 1) / groupSize;
+
+	FILE *file = fopen(name, "r");
+	if (!file)
+		printf("Could not open the ensemble file '%s'.\n", name);
+	while (file && fgets(line, sizeof(line), file))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0' || line[0] == '#')
+			continue;
+
+		// Doubling the capacity keeps the cost of growing it small.
+		if (numMembers == capacity)
+		{
+			capacity = (capacity ? 2 * capacity : 64);
+			members = (char **)realloc(members, capacity * sizeof(char *));
+		}
+		members[numMembers] = (char *)malloc(strlen(line) + 1);
+		strcpy(members[numMembers++], line);
+	}
+	if (file)
+		fclose(file);
+
+	results = (double *)calloc((size_t)numMembers * ENSEMBLE_NUM_RESULTS + 1, sizeof(double));
+	groups = (int *)calloc(numMembers + 1, sizeof(int));
+
+	// Each request carries the results of the group's previous member (if any); answer it with the next member,
+	// or -1 once there are none left, after which that group does not ask again.
+	while (active > 0)
+	{
+		MPI_Recv(request, 1 + ENSEMBLE_NUM_RESULTS, MPI_DOUBLE, MPI_ANY_SOURCE, ENSEMBLE_TAG_RESULT, comm, &status);
+		int member = (int)request[0], reply[2] = {-1, 0};
+		if (member >= 0)
+		{
+			memcpy(&results[member * ENSEMBLE_NUM_RESULTS], &request[1], ENSEMBLE_NUM_RESULTS * sizeof(double));
+			if (!request[1 + ENSEMBLE_FAILED])
+				busy += request[1 + ENSEMBLE_TIME];
+		}
+
+		if (next < numMembers)
+		{
+			groups[next] = (status.MPI_SOURCE - 1) / groupSize;
+			reply[0] = next;
+			reply[1] = strlen(members[next]) + 1;
+		}
+		else
+			active--;
+
+		MPI_Send(reply, 2, MPI_INT, status.MPI_SOURCE, ENSEMBLE_TAG_MEMBER, comm);
+		if (reply[0] >= 0)
+			MPI_Send(members[next++], reply[1], MPI_CHAR, status.MPI_SOURCE, ENSEMBLE_TAG_MEMBER, comm);
+	}
+
+	// The results, in the order of the file.
+	printf("\n%-8s%-7s", "Member", "Group");
+	for (i = ENSEMBLE_ITERATIONS; i < ENSEMBLE_NUM_RESULTS; i++)
+		printf("%-14s", ensembleResultNames[i]);
+	printf("Options\n");
+	for (i = 0; i < numMembers; i++)
+	{
+		const double *r = &results[i * ENSEMBLE_NUM_RESULTS];
+		printf("%-8d%-7d", i, groups[i]);
+		if (r[ENSEMBLE_FAILED])
+			printf("%-14s%-14s%-14s%-14s%-14s", "failed", "", "", "", "");
+		else
+			printf("%-14d%-14s%-14g%-14g%-14g", (int)r[ENSEMBLE_ITERATIONS], (r[ENSEMBLE_CONVERGED] ? "yes" : "no"), r[ENSEMBLE_CHANGE], r[ENSEMBLE_MEAN], r[ENSEMBLE_TIME]);
+		printf("%s\n", members[i]);
+		free(members[i]);
+	}
+
+	double time = MPI_Wtime() - startTime;
+	printf("\nRan %d member(s) on %d group(s) of %d process(es) in %g s; the groups spent %.0f%% of that iterating.\n", numMembers, numGroups, groupSize, time, (time > 0.0 ? 100.0 * busy / (numGroups * time) : 0.0));
+
+	free(members);
+	free(results);
+	free(groups);
+	return (file ? 0 : -1);
+}
+
+//
+// Prepares to ask rank 0 of comm for members to run on groupComm.
+//
+void ensembleCreate(Ensemble *ens, MPI_Comm comm, MPI_Comm groupComm)
+{
+	ens->comm = comm;
+	ens->groupComm = groupComm;
+	ens->member = -1;
+	ens->options[0] = '\0';
+	MPI_Comm_rank(groupComm, &ens->groupRank);
+}
+
+//
+// Reports the results of the previous member (which are ignored before the first, and only need to be
+// valid on the first rank of the group), and gets the next member and its options for the whole group.
+// Returns the member, or -1 once there are none left. Collective over the group.
+//
+int ensembleNext(Ensemble *ens, const double *results)
+{
+	int reply[2];
+
+	if (ens->groupRank == 0)
+	{
+		double request[1 + ENSEMBLE_NUM_RESULTS] = {ens->member};
+		if (ens->member >= 0)
+			memcpy(&request[1], results, ENSEMBLE_NUM_RESULTS * sizeof(double));
+		MPI_Send(request, 1 + ENSEMBLE_NUM_RESULTS, MPI_DOUBLE, 0, ENSEMBLE_TAG_RESULT, ens->comm);
+
+		MPI_Recv(reply, 2, MPI_INT, 0, ENSEMBLE_TAG_MEMBER, ens->comm, MPI_STATUS_IGNORE);
+		if (reply[0] >= 0)
+			MPI_Recv(ens->options, reply[1], MPI_CHAR, 0, ENSEMBLE_TAG_MEMBER, ens->comm, MPI_STATUS_IGNORE);
+	}
+
+	MPI_Bcast(reply, 2, MPI_INT, 0, ens->groupComm);
+	if (reply[0] >= 0)
+		MPI_Bcast(ens->options, reply[1], MPI_CHAR, 0, ens->groupComm);
+
+	return (ens->member = reply[0]);
+}
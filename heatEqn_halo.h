@@ -0,0 +1,650 @@
+//
+// Ghost-cell ('halo') exchange for the 2D heat equation solver in heatEqn.c.
+//
+// Several interchangeable backends are provided so that they can be compared at run time; all of them
+// fill exactly the same ghost cells, so the results do not depend on which one is used.
+// For simplicity everything is kept in this header, i.e. no .c implementation file.
+//
+// Usage:
+//
+// haloCreate( &halo, backend, comm, rows, cols, ghost );	// Once, before the iterations. Allocates halo.grid.
+// haloStart ( &halo );										// Each exchange; start sending the edge cells.
+// haloFinish( &halo );										// Each exchange; ghost cells valid after this returns.
+// haloFree  ( &halo );										// Once, after the iterations. Also frees halo.grid.
+//
+// For coupled fields (e.g. the two species of a reaction-diffusion model), haloCreateFields( &halo, backend,
+// comm, rows, cols, ghost, fields ) instead allocates a grid with 'fields' floats per cell, interleaved (the
+// fields of each cell are adjacent), so the ghost cells of every field travel together: one message per
+// direction, the same as for a single field, rather than one per field. Such a grid is exactly a grid of single
+// floats with 'fields' times as many columns and layers of ghost columns, so the exchange just describes it
+// as one; every backend supports it.
+//
+// For red-black orderings, haloCreateColour( &red, &halo, parity ) prepares a second exchange over the same
+// grid that only sends and receives the cells of one colour, i.e. half of them. It must be freed (with
+// haloFree(), which leaves the grid alone) before the exchange it was created from.
+//
+// The grid is allocated here rather than by the caller, as the one-sided and shared-memory backends need
+// it to live in memory that MPI has allocated for a window. It is aligned to a cache line where possible,
+// and each row is padded to a whole number of cache lines, so every row has the same alignment; the
+// distance between the start of successive rows (in floats) is halo.stride.
+//
+// Between haloStart() and haloFinish() the edge cells (that are being sent) must not be modified, and the
+// ghost cells (being received) must not be read.
+//
+// The grid can have more than one layer of ghost cells, so that several iterations can be performed
+// between exchanges. Those iterations also need the ghost cells in the corners, i.e. from the diagonal
+// neighbours. These are forwarded via the side neighbours by exchanging in two phases: first the rows,
+// then the columns including the ghost rows that have just been received. The second phase is performed
+// by haloFinish(), so only the first overlaps with any computation between haloStart() and haloFinish().
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#define HALO_ALIGNMENT 64			// Alignment of the grid in bytes, i.e. one cache line.
+#define HALO_ALIGNMENT_STRING "64" // The same, as an MPI info value (only honoured by MPI-4 libraries).
+
+//
+// The available backends.
+//
+typedef enum
+{
+	HALO_PERSISTENT, // Persistent point-to-point requests, set up once and restarted every iteration.
+	HALO_NEIGHBOUR,	 // A single non-blocking neighbourhood collective over the Cartesian communicator.
+	HALO_RMA,		 // One-sided MPI_Put into the neighbours' ghost cells, with PSCW synchronisation between neighbours only.
+	HALO_RMA_FENCE,	 // As HALO_RMA, but synchronised with MPI_Win_fence over the whole window.
+	HALO_SHARED,	 // Neighbours on the same node copy directly from each other's grids in a shared window;
+					 // only neighbours on other nodes use (persistent) messages.
+	HALO_NUM_BACKENDS
+} HaloBackend;
+
+const char *haloBackendNames[HALO_NUM_BACKENDS] = {"persistent", "neighbour", "rma", "rma-fence", "shared"};
+
+// The time spent in haloStart() (posting the transfers, which includes any packing by MPI or by hand) and in
+// haloFinish() (waiting for them, and the whole of any second phase), by all the exchanges of this process,
+// and the number of exchanges. Read by the profiling in heatEqn_profile.h.
+double haloPostTime = 0.0, haloWaitTime = 0.0;
+long haloExchanges = 0;
+
+// Directions. This is the neighbour order used by neighbourhood collectives on a 2D Cartesian
+// communicator, i.e. the negative then the positive direction for each dimension in turn.
+enum
+{
+	HALO_UP,
+	HALO_DOWN,
+	HALO_LEFT,
+	HALO_RIGHT
+};
+
+//
+// Everything needed to exchange the ghost cells of one local grid.
+//
+typedef struct
+{
+	HaloBackend backend;
+	MPI_Comm comm;						// 2D Cartesian communicator over the blocks.
+	int neighbours[4];					// Ranks of the neighbouring blocks in comm; MPI_PROC_NULL at the domain boundary.
+	int neighbourSizes[8];				// The rows and columns of each neighbour's block.
+	float *grid;						// The local grid, including the ghost cells.
+	int rows, cols;						// Size of the local grid excluding the ghost cells.
+	int fields;							// The number of floats in each cell, i.e. of interleaved fields.
+	int stride;							// The distance between rows in grid (in floats), i.e. cols plus the ghost cells and padding.
+	int ghost;							// The number of layers of ghost cells.
+	int numPhases;						// 1 to exchange all four directions together, 2 to exchange rows then columns.
+	int parity;							// Only exchange the cells with (row+col)%2 == parity, or all cells if -1.
+	MPI_Datatype rowType, columnType;	// The 'ghost' rows or columns sent to / received from each neighbour.
+	MPI_Datatype sendTypes[4], recvTypes[4]; // The datatypes sent to / received from each direction.
+	MPI_Aint sendDispls[4], recvDispls[4]; // Byte offsets into grid of the cells sent to / received from each direction.
+	MPI_Request requests[8];			// Persistent requests (two per direction), or a request for the neighbourhood collective.
+	MPI_Aint targetDispls[4];			// One-sided backends only: offset (in floats) of the ghost cells in each neighbour's window.
+	MPI_Datatype targetTypes[4];		// One-sided backends only: the layout of those ghost cells.
+	MPI_Win win;						// One-sided and shared backends only: window over the whole grid.
+	MPI_Group neighbourGroup;			// HALO_RMA only: the neighbouring ranks, for post-start-complete-wait.
+	MPI_Comm nodeComm;					// HALO_SHARED only: the ranks that share memory with this one.
+	float *neighbourGrids[4];			// HALO_SHARED only: neighbours' grids if on the same node, else NULL.
+} HaloExchange;
+
+//
+// Returns the backend with the given name, or -1 if there is no such backend.
+//
+int haloBackendFromName(const char *name)
+{
+	int backend;
+	for (backend = 0; backend < HALO_NUM_BACKENDS; backend++)
+		if (!strcmp(name, haloBackendNames[backend]))
+			return backend;
+
+	return -1;
+}
+
+//
+// The first row of the grid included in the columns that are exchanged. With more than one layer of ghost
+// cells the columns include the ghost rows, which carry the corner values.
+//
+int haloColumnStart(int ghost)
+{
+	return (ghost > 1 ? 0 : ghost);
+}
+
+//
+// The distance between rows (in floats) for a grid with the given number of columns, i.e. the columns and
+// the ghost cells either side, rounded up to a whole number of cache lines. For a grid of interleaved fields,
+// both are in floats, i.e. the numbers of cells times the number of fields.
+//
+int haloStride(int cols, int ghost)
+{
+	int lineFloats = HALO_ALIGNMENT / sizeof(float);
+	return (cols + 2 * ghost + lineFloats - 1) / lineFloats * lineFloats;
+}
+
+//
+// Offsets (in floats) of the edge cells sent to, and the ghost cells filled from, direction 'dir',
+// for a grid of the given size, with 'fields' floats per cell. The grid is stored row by row, including
+// the ghost cells.
+//
+MPI_Aint haloSendOffset(int dir, int rows, int cols, int ghost, int fields)
+{
+	MPI_Aint stride = haloStride(fields * cols, fields * ghost);
+
+	switch (dir)
+	{
+	case HALO_UP:
+		return ghost * stride + fields * ghost;
+	case HALO_DOWN:
+		return rows * stride + fields * ghost;
+	case HALO_LEFT:
+		return haloColumnStart(ghost) * stride + fields * ghost;
+	default:
+		return haloColumnStart(ghost) * stride + fields * cols;
+	}
+}
+
+MPI_Aint haloRecvOffset(int dir, int rows, int cols, int ghost, int fields)
+{
+	MPI_Aint stride = haloStride(fields * cols, fields * ghost);
+
+	switch (dir)
+	{
+	case HALO_UP:
+		return 0 * stride + fields * ghost;
+	case HALO_DOWN:
+		return (rows + ghost) * stride + fields * ghost;
+	case HALO_LEFT:
+		return haloColumnStart(ghost) * stride + 0;
+	default:
+		return haloColumnStart(ghost) * stride + fields * (cols + ghost);
+	}
+}
+
+//
+// Prints an error message and aborts if the grid could not be allocated. (Failures in MPI's own
+// allocations abort through the default MPI error handler.)
+//
+void haloAllocateFail(MPI_Comm comm, MPI_Aint gridBytes)
+{
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	printf("Could not allocate the local grid (%ld bytes) on rank %d.\n", (long)gridBytes, rank);
+	MPI_Abort(comm, EXIT_FAILURE);
+}
+
+//
+// Prepares to exchange the ghost cells of a rows*cols grid with 'ghost' layers of ghost cells all round, and
+// 'fields' interleaved floats per cell, stored row by row, and allocates that grid as halo->grid. 'comm' must
+// be a 2D Cartesian communicator.
+//
+void haloCreateFields(HaloExchange *halo, HaloBackend backend, MPI_Comm comm, int rows, int cols, int ghost, int fields)
+{
+	int dir, stride = haloStride(fields * cols, fields * ghost);
+	MPI_Aint gridBytes = (MPI_Aint)(rows + 2 * ghost) * stride * sizeof(float);
+	MPI_Info info;
+
+	halo->backend = backend;
+	halo->comm = comm;
+	halo->rows = rows;
+	halo->cols = cols;
+	halo->fields = fields;
+	halo->stride = stride;
+	halo->ghost = ghost;
+	halo->numPhases = (ghost > 1 ? 2 : 1);
+	halo->parity = -1;
+
+	MPI_Cart_shift(comm, 0, 1, &halo->neighbours[HALO_UP], &halo->neighbours[HALO_DOWN]);
+	MPI_Cart_shift(comm, 1, 1, &halo->neighbours[HALO_LEFT], &halo->neighbours[HALO_RIGHT]);
+
+	// Swap block sizes with the neighbours once, so nothing below assumes that all blocks are the same size.
+	int size[2] = {rows, cols};
+	MPI_Neighbor_allgather(size, 2, MPI_INT, halo->neighbourSizes, 2, MPI_INT, comm);
+
+	// Neither the rows (when there is more than one) nor the columns are contiguous in memory, so describe
+	// both with datatypes to avoid copying through temporary arrays. Every field of each cell is included.
+	MPI_Type_vector(ghost, fields * cols, stride, MPI_FLOAT, &halo->rowType);
+	MPI_Type_commit(&halo->rowType);
+	MPI_Type_vector(rows + 2 * (ghost - haloColumnStart(ghost)), fields * ghost, stride, MPI_FLOAT, &halo->columnType);
+	MPI_Type_commit(&halo->columnType);
+
+	halo->sendTypes[HALO_UP] = halo->sendTypes[HALO_DOWN] = halo->rowType;
+	halo->sendTypes[HALO_LEFT] = halo->sendTypes[HALO_RIGHT] = halo->columnType;
+	for (dir = 0; dir < 4; dir++)
+	{
+		halo->recvTypes[dir] = halo->sendTypes[dir];
+		halo->targetTypes[dir] = MPI_DATATYPE_NULL;
+	}
+
+	// The first and last rows and columns are sent; the ghost cells on the same side are received into.
+	for (dir = 0; dir < 4; dir++)
+	{
+		halo->sendDispls[dir] = haloSendOffset(dir, rows, cols, ghost, fields) * sizeof(float);
+		halo->recvDispls[dir] = haloRecvOffset(dir, rows, cols, ghost, fields) * sizeof(float);
+	}
+
+	switch (backend)
+	{
+	case HALO_PERSISTENT:
+		if (posix_memalign((void **)&halo->grid, HALO_ALIGNMENT, gridBytes))
+			haloAllocateFail(comm, gridBytes);
+
+		// The transfers are identical every iteration, so set them up once and just restart them. Messages are
+		// tagged with the direction they travel in; a message sent up arrives from below, and so on.
+		for (dir = 0; dir < 4; dir++)
+		{
+			MPI_Send_init((char *)halo->grid + halo->sendDispls[dir], 1, halo->sendTypes[dir], halo->neighbours[dir], dir, comm, &halo->requests[2 * dir]);
+			MPI_Recv_init((char *)halo->grid + halo->recvDispls[dir], 1, halo->recvTypes[dir], halo->neighbours[dir], dir ^ 1, comm, &halo->requests[2 * dir + 1]);
+		}
+		break;
+
+	case HALO_NEIGHBOUR:
+		if (posix_memalign((void **)&halo->grid, HALO_ALIGNMENT, gridBytes))
+			haloAllocateFail(comm, gridBytes);
+
+		// The collective request is created afresh each time it is started.
+		break;
+
+	case HALO_RMA:
+	case HALO_RMA_FENCE:
+		// Let MPI allocate the grid, so that it can be registered with the network for direct remote access.
+		// Neighbours put their edge cells straight into our ghost cells.
+		MPI_Info_create(&info);
+		MPI_Info_set(info, "no_locks", "true");
+		MPI_Info_set(info, "mpi_minimum_memory_alignment", HALO_ALIGNMENT_STRING);
+		MPI_Win_allocate(gridBytes, sizeof(float), info, comm, &halo->grid, &halo->win);
+		MPI_Info_free(&info);
+
+		// Our edge cells go to the ghost cells on the opposite side of each neighbour, whose rows are that
+		// neighbour's stride apart, which differs from ours if its block is a different width.
+		for (dir = 0; dir < 4; dir++)
+			if (halo->neighbours[dir] != MPI_PROC_NULL)
+			{
+				int neighbourStride = haloStride(fields * halo->neighbourSizes[2 * dir + 1], fields * ghost);
+				halo->targetDispls[dir] = haloRecvOffset(dir ^ 1, halo->neighbourSizes[2 * dir], halo->neighbourSizes[2 * dir + 1], ghost, fields);
+				if (dir == HALO_UP || dir == HALO_DOWN)
+					MPI_Type_vector(ghost, fields * cols, neighbourStride, MPI_FLOAT, &halo->targetTypes[dir]);
+				else
+					MPI_Type_vector(rows + 2 * (ghost - haloColumnStart(ghost)), fields * ghost, neighbourStride, MPI_FLOAT, &halo->targetTypes[dir]);
+				MPI_Type_commit(&halo->targetTypes[dir]);
+			}
+
+		// Post-start-complete-wait only synchronises with the neighbours, rather than every rank in the window.
+		if (backend == HALO_RMA)
+		{
+			int ranks[4], numNeighbours = 0;
+			MPI_Group commGroup;
+			for (dir = 0; dir < 4; dir++)
+				if (halo->neighbours[dir] != MPI_PROC_NULL)
+					ranks[numNeighbours++] = halo->neighbours[dir];
+			MPI_Comm_group(comm, &commGroup);
+			MPI_Group_incl(commGroup, numNeighbours, ranks, &halo->neighbourGroup);
+			MPI_Group_free(&commGroup);
+		}
+		break;
+
+	case HALO_SHARED:
+		// Allocate every grid on this node in one shared window. Non-contiguous allocation lets each rank's
+		// grid be placed in memory local to that rank.
+		MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &halo->nodeComm);
+		MPI_Info_create(&info);
+		MPI_Info_set(info, "alloc_shared_noncontig", "true");
+		MPI_Info_set(info, "mpi_minimum_memory_alignment", HALO_ALIGNMENT_STRING);
+		MPI_Win_allocate_shared(gridBytes, sizeof(float), info, halo->nodeComm, &halo->grid, &halo->win);
+		MPI_Info_free(&info);
+
+		// Find which neighbours are on this node, and where their grids are.
+		MPI_Group commGroup, nodeGroup;
+		int nodeRanks[4];
+		MPI_Comm_group(comm, &commGroup);
+		MPI_Comm_group(halo->nodeComm, &nodeGroup);
+		MPI_Group_translate_ranks(commGroup, 4, halo->neighbours, nodeGroup, nodeRanks);
+		MPI_Group_free(&commGroup);
+		MPI_Group_free(&nodeGroup);
+
+		for (dir = 0; dir < 4; dir++)
+		{
+			halo->neighbourGrids[dir] = NULL;
+			halo->requests[2 * dir] = halo->requests[2 * dir + 1] = MPI_REQUEST_NULL;
+
+			if (halo->neighbours[dir] == MPI_PROC_NULL)
+				continue;
+
+			if (nodeRanks[dir] != MPI_UNDEFINED)
+			{
+				MPI_Aint neighbourBytes;
+				int dispUnit;
+				MPI_Win_shared_query(halo->win, nodeRanks[dir], &neighbourBytes, &dispUnit, &halo->neighbourGrids[dir]);
+			}
+			else
+			{
+				// Only boundaries between nodes go through the network, as in HALO_PERSISTENT.
+				MPI_Send_init((char *)halo->grid + halo->sendDispls[dir], 1, halo->sendTypes[dir], halo->neighbours[dir], dir, comm, &halo->requests[2 * dir]);
+				MPI_Recv_init((char *)halo->grid + halo->recvDispls[dir], 1, halo->recvTypes[dir], halo->neighbours[dir], dir ^ 1, comm, &halo->requests[2 * dir + 1]);
+			}
+		}
+
+		// Keep a passive access epoch open throughout, so MPI_Win_sync() can be used to synchronise memory.
+		MPI_Win_lock_all(MPI_MODE_NOCHECK, halo->win);
+		break;
+
+	default:
+		break;
+	}
+}
+
+//
+// The same, for a grid of single floats.
+//
+void haloCreate(HaloExchange *halo, HaloBackend backend, MPI_Comm comm, int rows, int cols, int ghost)
+{
+	haloCreateFields(halo, backend, comm, rows, cols, ghost, 1);
+}
+
+//
+// Prepares to exchange just the ghost cells with (row+col)%2 == parity, in local coordinates (from 1), of the
+// grid of an existing exchange 'all', which must have a single layer of ghost cells and a single field. This is half of the
+// data, so red-black orderings can exchange each colour just after it has been updated. The window (for
+// the one-sided and shared backends) and the grid are those of 'all', and remain owned by it.
+//
+void haloCreateColour(HaloExchange *halo, const HaloExchange *all, int parity)
+{
+	int dir;
+
+	*halo = *all;
+	halo->parity = parity;
+
+	for (dir = 0; dir < 4; dir++)
+	{
+		// The edge cells sent to / the ghost cells received from this direction lie along one row or column.
+		int isRow = (dir == HALO_UP || dir == HALO_DOWN), length = (isRow ? halo->cols : halo->rows);
+		int sendLine = (dir == HALO_UP || dir == HALO_LEFT ? 1 : length);
+		int recvLine = (dir == HALO_UP || dir == HALO_LEFT ? 0 : length + 1);
+
+		// The first cell of the colour along each (from 1 or 2), and how many there are. These match the
+		// counts on the neighbour, as they are the same cells of the global grid.
+		int sendFirst = 1 + ((sendLine + 1 + parity) & 1), recvFirst = 1 + ((recvLine + 1 + parity) & 1);
+		int sendCount = (length - sendFirst + 2) / 2, recvCount = (length - recvFirst + 2) / 2;
+
+		int step = 2 * (isRow ? 1 : halo->stride);
+		MPI_Type_vector(sendCount, 1, step, MPI_FLOAT, &halo->sendTypes[dir]);
+		MPI_Type_commit(&halo->sendTypes[dir]);
+		MPI_Type_vector(recvCount, 1, step, MPI_FLOAT, &halo->recvTypes[dir]);
+		MPI_Type_commit(&halo->recvTypes[dir]);
+		halo->sendDispls[dir] = (isRow ? (MPI_Aint)sendLine * halo->stride + sendFirst : (MPI_Aint)sendFirst * halo->stride + sendLine) * sizeof(float);
+		halo->recvDispls[dir] = (isRow ? (MPI_Aint)recvLine * halo->stride + recvFirst : (MPI_Aint)recvFirst * halo->stride + recvLine) * sizeof(float);
+
+		// The same cells in the neighbour's grid (which may have a different stride), for one-sided access.
+		halo->targetTypes[dir] = MPI_DATATYPE_NULL;
+		if ((halo->backend == HALO_RMA || halo->backend == HALO_RMA_FENCE) && halo->neighbours[dir] != MPI_PROC_NULL)
+		{
+			int neighbourStride = haloStride(halo->neighbourSizes[2 * dir + 1], 1);
+			int targetLine = (dir == HALO_UP || dir == HALO_LEFT ? halo->neighbourSizes[2 * dir + !isRow] + 1 : 0);
+			MPI_Type_vector(sendCount, 1, 2 * (isRow ? 1 : neighbourStride), MPI_FLOAT, &halo->targetTypes[dir]);
+			MPI_Type_commit(&halo->targetTypes[dir]);
+			halo->targetDispls[dir] = (isRow ? (MPI_Aint)targetLine * neighbourStride + sendFirst : (MPI_Aint)sendFirst * neighbourStride + targetLine);
+		}
+	}
+
+	// Requests for the backends that use them, as in haloCreate().
+	for (dir = 0; dir < 4; dir++)
+	{
+		halo->requests[2 * dir] = halo->requests[2 * dir + 1] = MPI_REQUEST_NULL;
+		if (halo->backend == HALO_PERSISTENT || (halo->backend == HALO_SHARED && halo->neighbours[dir] != MPI_PROC_NULL && !halo->neighbourGrids[dir]))
+		{
+			MPI_Send_init((char *)halo->grid + halo->sendDispls[dir], 1, halo->sendTypes[dir], halo->neighbours[dir], dir, halo->comm, &halo->requests[2 * dir]);
+			MPI_Recv_init((char *)halo->grid + halo->recvDispls[dir], 1, halo->recvTypes[dir], halo->neighbours[dir], dir ^ 1, halo->comm, &halo->requests[2 * dir + 1]);
+		}
+	}
+}
+
+//
+// One-sided backends only: puts this rank's edge cells into the neighbours' ghost cells, for directions
+// firstDir to lastDir inclusive.
+//
+void haloPutEdges(HaloExchange *halo, int firstDir, int lastDir)
+{
+	int dir;
+	for (dir = firstDir; dir <= lastDir; dir++)
+		if (halo->neighbours[dir] != MPI_PROC_NULL)
+			MPI_Put((char *)halo->grid + halo->sendDispls[dir], 1, halo->sendTypes[dir],
+					halo->neighbours[dir], halo->targetDispls[dir], 1, halo->targetTypes[dir], halo->win);
+}
+
+//
+// Shared backend only: copies the edge cells of the neighbours on this node straight into our ghost cells,
+// for directions firstDir to lastDir inclusive.
+//
+void haloCopyFromNeighbours(HaloExchange *halo, int firstDir, int lastDir)
+{
+	int dir, i, numRows, numCols, ghost = halo->ghost, fields = halo->fields;
+	size_t stride = halo->stride;
+
+	for (dir = firstDir; dir <= lastDir; dir++)
+	{
+		if (!halo->neighbourGrids[dir])
+			continue;
+
+		// The neighbour's edge cells on the side facing us, in its own grid (which may be a different size).
+		int neighbourRows = halo->neighbourSizes[2 * dir], neighbourCols = halo->neighbourSizes[2 * dir + 1];
+		size_t neighbourStride = haloStride(fields * neighbourCols, fields * ghost);
+		float *dest = (float *)((char *)halo->grid + halo->recvDispls[dir]);
+
+		// One colour only: every other cell along the edge, i.e. every other ghost cell.
+		if (halo->parity >= 0)
+		{
+			int count, isRow = (dir == HALO_UP || dir == HALO_DOWN);
+			MPI_Type_size(halo->recvTypes[dir], &count);
+			count /= sizeof(float);
+
+			// The neighbour's first cell is in the same column (or row) as our first ghost cell, along its edge.
+			size_t destRow = (dest - halo->grid) / stride, destCol = (dest - halo->grid) % stride;
+			int edge = (dir == HALO_UP || dir == HALO_LEFT ? (isRow ? neighbourRows : neighbourCols) : 1);
+			const float *src = halo->neighbourGrids[dir] + (isRow ? edge * neighbourStride + destCol : destRow * neighbourStride + edge);
+			for (i = 0; i < count; i++)
+				dest[i * 2 * (isRow ? 1 : stride)] = src[i * 2 * (isRow ? 1 : neighbourStride)];
+			continue;
+		}
+
+		const float *src = halo->neighbourGrids[dir] + haloSendOffset(dir ^ 1, neighbourRows, neighbourCols, ghost, fields);
+
+		// The same shapes as rowType and columnType (in floats).
+		if (dir == HALO_UP || dir == HALO_DOWN)
+		{
+			numRows = ghost;
+			numCols = fields * halo->cols;
+		}
+		else
+		{
+			numRows = halo->rows + 2 * (ghost - haloColumnStart(ghost));
+			numCols = fields * ghost;
+		}
+
+		for (i = 0; i < numRows; i++)
+			memcpy(dest + i * stride, src + i * neighbourStride, numCols * sizeof(float));
+	}
+}
+
+//
+// Starts and finishes one phase of the exchange, i.e. all four directions, or the rows or the columns.
+//
+void haloStartPhase(HaloExchange *halo, int phase)
+{
+	int dir, counts[4];
+	int firstDir = (halo->numPhases == 1 ? 0 : 2 * phase), lastDir = (halo->numPhases == 1 ? 3 : 2 * phase + 1);
+
+	switch (halo->backend)
+	{
+	case HALO_PERSISTENT:
+		MPI_Startall(2 * (lastDir - firstDir + 1), &halo->requests[2 * firstDir]);
+		break;
+
+	case HALO_NEIGHBOUR:
+		// All directions in the phase in one call, so the MPI library can schedule the whole pattern at once.
+		for (dir = 0; dir < 4; dir++)
+			counts[dir] = (dir >= firstDir && dir <= lastDir);
+		MPI_Ineighbor_alltoallw(halo->grid, counts, halo->sendDispls, halo->sendTypes,
+								halo->grid, counts, halo->recvDispls, halo->recvTypes, halo->comm, &halo->requests[0]);
+		break;
+
+	case HALO_RMA:
+		// Expose our ghost cells to the neighbours, then access theirs. There is no receive to match.
+		MPI_Win_post(halo->neighbourGroup, 0, halo->win);
+		MPI_Win_start(halo->neighbourGroup, 0, halo->win);
+		haloPutEdges(halo, firstDir, lastDir);
+		break;
+
+	case HALO_RMA_FENCE:
+		// The opening fence also ensures every neighbour has finished reading its ghost cells from last time.
+		MPI_Win_fence(MPI_MODE_NOPRECEDE, halo->win);
+		haloPutEdges(halo, firstDir, lastDir);
+		break;
+
+	case HALO_SHARED:
+		// Start the messages between nodes first, then wait until every rank on this node has finished
+		// updating its edge cells before reading them.
+		for (dir = firstDir; dir <= lastDir; dir++)
+			if (halo->requests[2 * dir] != MPI_REQUEST_NULL)
+				MPI_Startall(2, &halo->requests[2 * dir]);
+		MPI_Win_sync(halo->win);
+		MPI_Barrier(halo->nodeComm);
+		MPI_Win_sync(halo->win);
+		haloCopyFromNeighbours(halo, firstDir, lastDir);
+		break;
+
+	default:
+		break;
+	}
+}
+
+void haloFinishPhase(HaloExchange *halo, int phase)
+{
+	int firstDir = (halo->numPhases == 1 ? 0 : 2 * phase), lastDir = (halo->numPhases == 1 ? 3 : 2 * phase + 1);
+
+	switch (halo->backend)
+	{
+	case HALO_NEIGHBOUR:
+		MPI_Wait(&halo->requests[0], MPI_STATUS_IGNORE);
+		break;
+
+	case HALO_RMA:
+		MPI_Win_complete(halo->win); // Our puts have completed ...
+		MPI_Win_wait(halo->win);	 // ... and so have the neighbours' puts into our ghost cells.
+		break;
+
+	case HALO_RMA_FENCE:
+		MPI_Win_fence(MPI_MODE_NOSUCCEED, halo->win);
+		break;
+
+	case HALO_SHARED:
+		// The edge cells may not be modified until every neighbour on this node has copied them.
+		MPI_Waitall(2 * (lastDir - firstDir + 1), &halo->requests[2 * firstDir], MPI_STATUSES_IGNORE);
+		MPI_Win_sync(halo->win);
+		MPI_Barrier(halo->nodeComm);
+		break;
+
+	default:
+		MPI_Waitall(2 * (lastDir - firstDir + 1), &halo->requests[2 * firstDir], MPI_STATUSES_IGNORE);
+		break;
+	}
+}
+
+//
+// Starts exchanging the ghost cells.
+//
+void haloStart(HaloExchange *halo)
+{
+	double start = MPI_Wtime();
+	haloStartPhase(halo, 0);
+	haloPostTime += MPI_Wtime() - start;
+	haloExchanges++;
+}
+
+//
+// Waits until the ghost cells have been received and the edge cells sent. With two phases, this also
+// performs the whole of the second phase.
+//
+void haloFinish(HaloExchange *halo)
+{
+	double start = MPI_Wtime();
+	haloFinishPhase(halo, 0);
+
+	if (halo->numPhases == 2)
+	{
+		haloStartPhase(halo, 1);
+		haloFinishPhase(halo, 1);
+	}
+	haloWaitTime += MPI_Wtime() - start;
+}
+
+//
+// Frees all resources associated with the exchange, including the grid unless it was created by
+// haloCreateColour().
+//
+void haloFree(HaloExchange *halo)
+{
+	int i;
+
+	if (halo->backend == HALO_PERSISTENT || halo->backend == HALO_SHARED)
+		for (i = 0; i < 8; i++)
+			if (halo->requests[i] != MPI_REQUEST_NULL)
+				MPI_Request_free(&halo->requests[i]);
+
+	if (halo->parity >= 0)
+	{
+		for (i = 0; i < 4; i++)
+		{
+			MPI_Type_free(&halo->sendTypes[i]);
+			MPI_Type_free(&halo->recvTypes[i]);
+			if (halo->targetTypes[i] != MPI_DATATYPE_NULL)
+				MPI_Type_free(&halo->targetTypes[i]);
+		}
+		return;
+	}
+
+	for (i = 0; i < 4; i++)
+		if (halo->targetTypes[i] != MPI_DATATYPE_NULL)
+			MPI_Type_free(&halo->targetTypes[i]);
+
+	switch (halo->backend)
+	{
+	case HALO_RMA:
+		MPI_Group_free(&halo->neighbourGroup);
+		MPI_Win_free(&halo->win);
+		break;
+
+	case HALO_RMA_FENCE:
+		MPI_Win_free(&halo->win);
+		break;
+
+	case HALO_SHARED:
+		MPI_Win_unlock_all(halo->win);
+		MPI_Win_free(&halo->win);
+		MPI_Comm_free(&halo->nodeComm);
+		break;
+
+	default:
+		free(halo->grid);
+		break;
+	}
+
+	MPI_Type_free(&halo->rowType);
+	MPI_Type_free(&halo->columnType);
+}
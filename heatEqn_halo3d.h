@@ -0,0 +1,205 @@
+//
+// Ghost-cell ('halo') exchange for the 3D heat equation solver in heatEqn3d.c. Uses HALO_ALIGNMENT,
+// haloStride() and haloAllocateFail() from heatEqn_halo.h, which must be included first.
+//
+// Usage:
+//
+// halo3dCreate( &halo, packing, comm, sizes );	// Once, before the iterations. Allocates halo.grid.
+// halo3dStart ( &halo );						// Each exchange; start sending the face cells.
+// halo3dFinish( &halo );						// Each exchange; ghost cells valid after this returns.
+// halo3dFree  ( &halo );						// Once, after the iterations. Also frees halo.grid.
+//
+// The grid is stored plane by plane, each plane row by row, with one layer of ghost cells all round. As in
+// 2D, rows are padded to a whole number of cache lines. The 7-point stencil only reads the ghost cells on
+// the six faces, never those along the edges or at the corners, so only the faces are exchanged, all six
+// at once, with persistent requests that are set up once and restarted for every exchange.
+//
+// Each face is described by a subarray datatype, but how well MPI copies them depends on the face. The
+// faces between planes are contiguous (apart from the padding), and those between rows are planes' worth
+// of contiguous rows, but the faces between columns are a single float from every row, which many MPI
+// libraries copy one element at a time on one thread. So by default those two faces are instead packed
+// into (and unpacked from) contiguous buffers here, with all the threads; -pack datatypes uses subarrays
+// for all six. For the same reason heatEqn3d.c splits the domain into the fewest blocks across columns.
+//
+
+// How the faces between columns are sent.
+typedef enum
+{
+	HALO3D_PACKED,	  // Packed into contiguous buffers by all the threads.
+	HALO3D_DATATYPES, // Described by subarray datatypes, like the other faces.
+	HALO3D_NUM_PACKINGS
+} Halo3dPacking;
+
+const char *halo3dPackingNames[HALO3D_NUM_PACKINGS] = {"packed", "datatypes"};
+
+// Directions. As in 2D, this is the order of the neighbours of a 3D Cartesian communicator: the
+// negative then the positive direction for planes, rows and columns in turn.
+enum
+{
+	HALO3D_BACK,
+	HALO3D_FRONT,
+	HALO3D_UP,
+	HALO3D_DOWN,
+	HALO3D_LEFT,
+	HALO3D_RIGHT
+};
+
+//
+// Everything needed to exchange the ghost cells of one local grid.
+//
+typedef struct
+{
+	Halo3dPacking packing;
+	MPI_Comm comm;						// 3D Cartesian communicator over the blocks.
+	int neighbours[6];					// Ranks of the neighbouring blocks in comm; MPI_PROC_NULL at the domain boundary.
+	float *grid;						// The local grid, including the ghost cells.
+	int sizes[3];						// Size of the local grid excluding the ghost cells: planes, rows and columns.
+	size_t rowStride, planeStride;		// The distance between rows, and between planes, in grid.
+	MPI_Datatype sendTypes[6], recvTypes[6]; // The face cells sent to / ghost cells received from each direction.
+	float *packBuffers[2][2];			// HALO3D_PACKED only: cells sent to [0] / received from [1] the left and right.
+	MPI_Request requests[12];			// Persistent requests, receive then send for each direction.
+} Halo3dExchange;
+
+//
+// Returns the packing with the given name, or -1 if there is no such packing.
+//
+int halo3dPackingFromName(const char *name)
+{
+	int packing;
+	for (packing = 0; packing < HALO3D_NUM_PACKINGS; packing++)
+		if (!strcmp(name, halo3dPackingNames[packing]))
+			return packing;
+
+	return -1;
+}
+
+//
+// Prepares to exchange the ghost cells of a grid with sizes[0] planes of sizes[1] rows of sizes[2] columns,
+// and allocates that grid as halo->grid. 'comm' must be a 3D Cartesian communicator.
+//
+void halo3dCreate(Halo3dExchange *halo, Halo3dPacking packing, MPI_Comm comm, const int *sizes)
+{
+	int dir, side, i;
+
+	halo->packing = packing;
+	halo->comm = comm;
+	memcpy(halo->sizes, sizes, 3 * sizeof(int));
+	halo->rowStride = haloStride(sizes[2], 1);
+	halo->planeStride = (size_t)(sizes[1] + 2) * halo->rowStride;
+
+	for (dir = 0; dir < 3; dir++)
+		MPI_Cart_shift(comm, dir, 1, &halo->neighbours[2 * dir], &halo->neighbours[2 * dir + 1]);
+
+	MPI_Aint gridBytes = (MPI_Aint)(sizes[0] + 2) * halo->planeStride * sizeof(float);
+	if (posix_memalign((void **)&halo->grid, HALO_ALIGNMENT, gridBytes))
+		haloAllocateFail(comm, gridBytes);
+
+	// Each face is the whole of the local grid in the other two dimensions. The cells sent are the first or
+	// last layer of the local grid, and the ghost cells received are the layer beyond.
+	int arraySizes[3] = {sizes[0] + 2, sizes[1] + 2, (int)halo->rowStride};
+	for (dir = 0; dir < 6; dir++)
+	{
+		int axis = dir / 2, subSizes[3] = {sizes[0], sizes[1], sizes[2]}, sendStarts[3] = {1, 1, 1}, recvStarts[3] = {1, 1, 1};
+		subSizes[axis] = 1;
+		sendStarts[axis] = (dir % 2 ? sizes[axis] : 1);
+		recvStarts[axis] = (dir % 2 ? sizes[axis] + 1 : 0);
+
+		MPI_Type_create_subarray(3, arraySizes, subSizes, sendStarts, MPI_ORDER_C, MPI_FLOAT, &halo->sendTypes[dir]);
+		MPI_Type_create_subarray(3, arraySizes, subSizes, recvStarts, MPI_ORDER_C, MPI_FLOAT, &halo->recvTypes[dir]);
+		MPI_Type_commit(&halo->sendTypes[dir]);
+		MPI_Type_commit(&halo->recvTypes[dir]);
+	}
+
+	// The receives are set up first, so they are posted before the sends when the requests are started.
+	// Messages are tagged with the direction they are sent in.
+	for (dir = 0; dir < 6; dir++)
+	{
+		int opposite = dir ^ 1;
+		if (packing == HALO3D_PACKED && dir >= HALO3D_LEFT)
+		{
+			int count = sizes[0] * sizes[1];
+			side = dir - HALO3D_LEFT;
+			for (i = 0; i < 2; i++)
+				if (!(halo->packBuffers[i][side] = (float *)malloc(count * sizeof(float))))
+					haloAllocateFail(comm, count * sizeof(float));
+			MPI_Recv_init(halo->packBuffers[1][side], count, MPI_FLOAT, halo->neighbours[dir], opposite, comm, &halo->requests[2 * dir]);
+			MPI_Send_init(halo->packBuffers[0][side], count, MPI_FLOAT, halo->neighbours[dir], dir, comm, &halo->requests[2 * dir + 1]);
+		}
+		else
+		{
+			MPI_Recv_init(halo->grid, 1, halo->recvTypes[dir], halo->neighbours[dir], opposite, comm, &halo->requests[2 * dir]);
+			MPI_Send_init(halo->grid, 1, halo->sendTypes[dir], halo->neighbours[dir], dir, comm, &halo->requests[2 * dir + 1]);
+		}
+	}
+}
+
+//
+// Copies the column 'col' of the local grid (all planes and rows) to or from a contiguous buffer.
+//
+void halo3dPackColumn(Halo3dExchange *halo, float *buffer, int col, int unpack)
+{
+	int plane, row, rows = halo->sizes[1];
+
+#pragma omp parallel for collapse(2) schedule(static)
+	for (plane = 1; plane < halo->sizes[0] + 1; plane++)
+		for (row = 1; row < rows + 1; row++)
+		{
+			float *cell = &halo->grid[plane * halo->planeStride + row * halo->rowStride + col];
+			float *packed = &buffer[(plane - 1) * rows + row - 1];
+			if (unpack)
+				*cell = *packed;
+			else
+				*packed = *cell;
+		}
+}
+
+//
+// Starts exchanging the ghost cells. The face cells must not be modified, nor the ghost cells read, until
+// halo3dFinish() returns.
+//
+void halo3dStart(Halo3dExchange *halo)
+{
+	int side;
+
+	if (halo->packing == HALO3D_PACKED)
+		for (side = 0; side < 2; side++)
+			if (halo->neighbours[HALO3D_LEFT + side] != MPI_PROC_NULL)
+				halo3dPackColumn(halo, halo->packBuffers[0][side], (side ? halo->sizes[2] : 1), 0);
+
+	MPI_Startall(12, halo->requests);
+}
+
+//
+// Waits for the exchange started by halo3dStart() to complete.
+//
+void halo3dFinish(Halo3dExchange *halo)
+{
+	int side;
+
+	MPI_Waitall(12, halo->requests, MPI_STATUSES_IGNORE);
+
+	if (halo->packing == HALO3D_PACKED)
+		for (side = 0; side < 2; side++)
+			if (halo->neighbours[HALO3D_LEFT + side] != MPI_PROC_NULL)
+				halo3dPackColumn(halo, halo->packBuffers[1][side], (side ? halo->sizes[2] + 1 : 0), 1);
+}
+
+//
+// Frees everything, including the grid.
+//
+void halo3dFree(Halo3dExchange *halo)
+{
+	int dir;
+
+	for (dir = 0; dir < 12; dir++)
+		MPI_Request_free(&halo->requests[dir]);
+	for (dir = 0; dir < 6; dir++)
+	{
+		MPI_Type_free(&halo->sendTypes[dir]);
+		MPI_Type_free(&halo->recvTypes[dir]);
+	}
+	if (halo->packing == HALO3D_PACKED)
+		for (dir = 0; dir < 4; dir++)
+			free(halo->packBuffers[dir / 2][dir % 2]);
+	free(halo->grid);
+}
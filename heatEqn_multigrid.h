@@ -0,0 +1,424 @@
+//
+// Geometric multigrid V-cycles for the steady state of the 2D heat equation in heatEqn.c, i.e. Laplace's
+// equation 4u - (sum of the four neighbours) = f on each local grid, with the ghost cells at the edge of
+// the domain fixed at zero. Builds on the ghost-cell exchange in heatEqn_halo.h, which must be included first.
+//
+// Usage:
+//
+// mgCreate( &mg, &halo, backend, comm, p );	// Once. 'halo' is the fine grid's exchange; comm is p*p Cartesian.
+// mgCycle ( &mg, 0 );							// Each iteration; one V-cycle, updating halo.grid in place.
+// mgFree  ( &mg );								// Once, before freeing 'halo'.
+//
+// Each coarser level has half as many cells in each direction, down to a single cell. Cell (I,J) of a
+// coarse level covers cells 2I-1 and 2I by 2J-1 and 2J of the next finer one. The residual is restricted by
+// summing over these four cells, and corrections are interpolated linearly from the coarse cell and its two
+// nearest neighbours; this needs no corner ghost cells, so a single-layer exchange suffices on every level.
+// Red-black Gauss-Seidel, with per-colour exchanges as in the SOR solver, smooths on each level.
+//
+// On the finest level the boundary is at the centre of the ghost cells, but on coarser levels the ghost
+// cells extend beyond it (by half a fine cell, a fine cell and a half, ...). So that every level solves the
+// same problem, the ghost cells at the edge of the domain are set by linear extrapolation through the zero
+// at the boundary, rather than to zero; without this the corrections overshoot, increasingly so with more levels.
+//
+// Once the local grids become too small for communication to be worthwhile (or cannot be halved), the
+// residual is gathered onto rank 0, which continues with the remaining levels on its own, and the
+// correction is scattered back.
+//
+
+#include <math.h>
+
+#define MG_MAX_LEVELS 40 // Enough for any grid that fits in memory.
+#define MG_MIN_LOCAL 4	 // Gather onto one rank rather than make local grids smaller than this.
+#define MG_SMOOTHING 2	 // Red-black sweeps before and after each coarse-grid correction.
+
+//
+// One level of the hierarchy.
+//
+typedef struct
+{
+	int n;						// Size of the local grid (excluding the ghost cells) on this level.
+	int p;						// The number of ranks in each direction on this level.
+	MPI_Comm comm;				// p*p Cartesian communicator over the ranks on this level.
+	HaloExchange *halo;			// Exchange for (and storage of) the solution u.
+	HaloExchange ownHalo;		// The above, for all but the finest level, whose exchange belongs to the caller.
+	HaloExchange colourHalo[2]; // Exchanges for the red and the black cells of u.
+	float *f, *r;				// The right hand side, and the residual; same layout as u.
+	int gather;					// Non-zero if the next level is the same grid gathered onto rank 0.
+	float boundaryGhost;		// The ghost cells at the edge of the domain are this times the cell next to them.
+} MultigridLevel;
+
+typedef struct
+{
+	int numLevels; // The number of levels this rank takes part in.
+	MultigridLevel levels[MG_MAX_LEVELS];
+	MPI_Comm serialComm; // Rank 0 on its own, once gathered; MPI_COMM_NULL on other ranks (or if never gathered).
+} Multigrid;
+
+//
+// Allocates one array with the same layout as a level's grid, initialised to zero.
+//
+float *mgAllocate(MultigridLevel *level)
+{
+	float *a = NULL;
+	MPI_Aint bytes = (MPI_Aint)(level->n + 2) * level->halo->stride * sizeof(float);
+	if (posix_memalign((void **)&a, HALO_ALIGNMENT, bytes))
+		haloAllocateFail(level->comm, bytes);
+	memset(a, 0, bytes);
+	return a;
+}
+
+//
+// Adds a level of size n on the p*p ranks of comm, or just creates the exchanges for the finest level
+// if 'fine' is non-NULL.
+//
+void mgAddLevel(Multigrid *mg, HaloExchange *fine, HaloBackend backend, MPI_Comm comm, int p, int n)
+{
+	int i, rank, coords[2];
+	MultigridLevel *level = &mg->levels[mg->numLevels++];
+
+	level->n = n;
+	level->p = p;
+	level->comm = comm;
+	level->gather = 0;
+
+	// The distance from the centre of the cells next to the boundary to the boundary, in units of this level's
+	// cells, is 1 on the finest level, and (d+1/2)/2 on the next coarser level if it is d on this one (but
+	// stays the same when gathered, as the cells are the same size).
+	if (fine)
+		level->boundaryGhost = 0.0f;
+	else
+	{
+		float d = 1.0f / (1.0f - level[-1].boundaryGhost);
+		if (!level[-1].gather)
+			d = (d + 0.5f) / 2.0f;
+		level->boundaryGhost = 1.0f - 1.0f / d;
+	}
+
+	if (fine)
+		level->halo = fine;
+	else
+	{
+		haloCreate(&level->ownHalo, backend, comm, n, n, 1);
+		level->halo = &level->ownHalo;
+	}
+
+	// A cell is red if the sum of its global row and column is even, as in the SOR solver.
+	MPI_Comm_rank(comm, &rank);
+	MPI_Cart_coords(comm, rank, 2, coords);
+	for (i = 0; i < 2; i++)
+		haloCreateColour(&level->colourHalo[i], level->halo, (i + (coords[0] + coords[1]) * n) % 2);
+
+	level->f = mgAllocate(level);
+	level->r = mgAllocate(level);
+}
+
+//
+// Sets up the hierarchy below the grid of the exchange 'fine', whose ghost cells must be a single layer
+// deep, on the p*p Cartesian communicator comm.
+//
+void mgCreate(Multigrid *mg, HaloExchange *fine, HaloBackend backend, MPI_Comm comm, int p)
+{
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+
+	mg->numLevels = 0;
+	mg->serialComm = MPI_COMM_NULL;
+	mgAddLevel(mg, fine, backend, comm, p, fine->rows);
+
+	while (mg->numLevels < MG_MAX_LEVELS)
+	{
+		MultigridLevel *level = &mg->levels[mg->numLevels - 1];
+
+		if (level->p > 1 && (level->n % 2 || level->n / 2 < MG_MIN_LOCAL))
+		{
+			// Gather the whole grid onto rank 0, which carries on alone.
+			MPI_Comm single;
+			int dims[2] = {1, 1}, periods[2] = {0, 0};
+			level->gather = 1;
+			MPI_Comm_split(comm, rank == 0 ? 0 : MPI_UNDEFINED, 0, &single);
+			if (rank != 0)
+				break;
+			MPI_Cart_create(single, 2, dims, periods, 0, &mg->serialComm);
+			MPI_Comm_free(&single);
+			mgAddLevel(mg, NULL, backend, mg->serialComm, 1, level->p * level->n);
+		}
+		else if (level->n % 2 == 0)
+			mgAddLevel(mg, NULL, backend, level->comm, level->p, level->n / 2);
+		else
+			break;
+	}
+}
+
+
+//
+// Sets the ghost cells of u at the edge of the domain, by extrapolation from the cells next to them.
+//
+void mgBoundary(MultigridLevel *level)
+{
+	int i, n = level->n;
+	size_t stride = level->halo->stride;
+	float *u = level->halo->grid, g = level->boundaryGhost;
+
+	if (g == 0.0f)
+		return;
+
+	for (i = 1; i < n + 1; i++)
+	{
+		if (level->halo->neighbours[HALO_UP] == MPI_PROC_NULL)
+			u[i] = g * u[stride + i];
+		if (level->halo->neighbours[HALO_DOWN] == MPI_PROC_NULL)
+			u[(n + 1) * stride + i] = g * u[n * stride + i];
+		if (level->halo->neighbours[HALO_LEFT] == MPI_PROC_NULL)
+			u[i * stride] = g * u[i * stride + 1];
+		if (level->halo->neighbours[HALO_RIGHT] == MPI_PROC_NULL)
+			u[i * stride + n + 1] = g * u[i * stride + n];
+	}
+}
+
+//
+// Fills all the ghost cells of u on a level.
+//
+void mgExchange(MultigridLevel *level)
+{
+	haloStart(level->halo);
+	haloFinish(level->halo);
+	mgBoundary(level);
+}
+
+//
+// Over-relaxes the cells with (row+col)%2 == parity in columns [c0,c1) of one row.
+//
+static inline void mgRelaxRow(MultigridLevel *level, int row, int c0, int c1, int parity, float omega)
+{
+	int col;
+	size_t stride = level->halo->stride;
+	float *u = level->halo->grid + row * stride;
+	const float *f = level->f + row * stride;
+
+#pragma omp simd
+	for (col = c0 + ((row + c0 + parity) & 1); col < c1; col += 2)
+		u[col] = (1.0f - omega) * u[col] + omega * 0.25f * (u[col + stride] + u[col - stride] + u[col + 1] + u[col - 1] + f[col]);
+}
+
+//
+// One red-black sweep over a level. Each colour starts by exchanging the other colour, which is all it reads,
+// so there is no need for the ghost cells to be valid beforehand. As in the SOR solver, the exchange
+// overlaps with the interior cells.
+//
+void mgSweep(MultigridLevel *level, float omega)
+{
+	int colour, row, n = level->n;
+
+	for (colour = 0; colour < 2; colour++)
+	{
+		int parity = level->colourHalo[colour].parity;
+
+		haloStart(&level->colourHalo[1 - colour]);
+
+#pragma omp parallel for schedule(static)
+		for (row = 2; row < n; row++)
+			mgRelaxRow(level, row, 2, n, parity, omega);
+
+		haloFinish(&level->colourHalo[1 - colour]);
+		mgBoundary(level); // Lags behind the cells next to the boundary by half a sweep.
+
+#pragma omp parallel for schedule(static)
+		for (row = 1; row < n + 1; row++)
+			if (row == 1 || row == n)
+				mgRelaxRow(level, row, 1, n + 1, parity, omega);
+			else
+			{
+				mgRelaxRow(level, row, 1, 2, parity, omega);
+				mgRelaxRow(level, row, n, n + 1, parity, omega);
+			}
+	}
+}
+
+//
+// Calculates the residual r = f - (4u - sum of neighbours) on a level, whose ghost cells must be valid.
+// Returns its largest magnitude.
+//
+float mgResidual(MultigridLevel *level)
+{
+	int row, col, n = level->n;
+	size_t stride = level->halo->stride;
+	const float *u = level->halo->grid, *f = level->f;
+	float *r = level->r, largest = 0.0f;
+
+#pragma omp parallel for private(col) reduction(max : largest) schedule(static)
+	for (row = 1; row < n + 1; row++)
+#pragma omp simd reduction(max : largest)
+		for (col = 1; col < n + 1; col++)
+		{
+			size_t i = row * stride + col;
+			r[i] = f[i] - (4.0f * u[i] - (u[i + stride] + u[i - stride] + u[i + 1] + u[i - 1]));
+			largest = (fabsf(r[i]) > largest ? fabsf(r[i]) : largest);
+		}
+
+	return largest;
+}
+
+//
+// The right hand side of the next coarser level is the residual summed over each 2x2 block of cells, i.e. the
+// average scaled by the factor of 4 by which h^2 grows. The solution there (the correction) starts from zero.
+//
+void mgRestrict(MultigridLevel *level, MultigridLevel *coarse)
+{
+	int row, col;
+	size_t stride = level->halo->stride, coarseStride = coarse->halo->stride;
+	const float *r = level->r;
+
+#pragma omp parallel for private(col) schedule(static)
+	for (row = 1; row < coarse->n + 1; row++)
+		for (col = 1; col < coarse->n + 1; col++)
+		{
+			size_t i = (2 * row - 1) * stride + 2 * col - 1;
+			coarse->f[row * coarseStride + col] = r[i] + r[i + 1] + r[i + stride] + r[i + stride + 1];
+		}
+
+	memset(coarse->halo->grid, 0, (size_t)(coarse->n + 2) * coarseStride * sizeof(float));
+}
+
+//
+// Adds the correction from the next coarser level, whose ghost cells must be valid, to u. Each fine cell
+// takes half of its coarse cell, plus a quarter of each of the two coarse neighbours on its side.
+//
+void mgProlong(MultigridLevel *level, MultigridLevel *coarse)
+{
+	int row, col;
+	size_t stride = level->halo->stride, coarseStride = coarse->halo->stride;
+	float *u = level->halo->grid;
+	const float *e = coarse->halo->grid;
+
+#pragma omp parallel for private(col) schedule(static)
+	for (row = 1; row < level->n + 1; row++)
+		for (col = 1; col < level->n + 1; col++)
+		{
+			const float *c = e + (row + 1) / 2 * coarseStride + (col + 1) / 2;
+			ptrdiff_t rowSide = (row % 2 ? -(ptrdiff_t)coarseStride : (ptrdiff_t)coarseStride), colSide = (col % 2 ? -1 : 1);
+			u[row * stride + col] += 0.5f * c[0] + 0.25f * (c[rowSide] + c[colSide]);
+		}
+}
+
+//
+// Gathers the residual of a level onto rank 0 as the right hand side of the next level (the same cells in
+// one grid), or scatters that level's solution back and adds it to u.
+//
+void mgGatherScatter(MultigridLevel *level, int scatter)
+{
+	int rank, k, i, n = level->n, p = level->p;
+	size_t blockSize = (size_t)n * n, stride = level->halo->stride;
+	float *block = (float *)malloc(blockSize * sizeof(float)), *all = NULL;
+
+	MPI_Comm_rank(level->comm, &rank);
+	MultigridLevel *serial = (rank == 0 ? level + 1 : NULL);
+	if (rank == 0)
+		all = (float *)malloc(p * p * blockSize * sizeof(float));
+
+	if (!scatter)
+	{
+		for (i = 0; i < n; i++)
+			memcpy(block + i * n, level->r + (i + 1) * stride + 1, n * sizeof(float));
+		MPI_Gather(block, blockSize, MPI_FLOAT, all, blockSize, MPI_FLOAT, 0, level->comm);
+	}
+
+	// Copy between the blocks of each rank, in rank order, and rank 0's grid.
+	if (rank == 0)
+		for (k = 0; k < p * p; k++)
+		{
+			int coords[2];
+			MPI_Cart_coords(level->comm, k, 2, coords);
+			for (i = 0; i < n; i++)
+			{
+				size_t cell = (size_t)(coords[0] * n + i + 1) * serial->halo->stride + coords[1] * n + 1;
+				if (scatter)
+					memcpy(all + k * blockSize + i * n, serial->halo->grid + cell, n * sizeof(float));
+				else
+					memcpy(serial->f + cell, all + k * blockSize + i * n, n * sizeof(float));
+			}
+		}
+
+	if (scatter)
+	{
+		int col;
+		MPI_Scatter(all, blockSize, MPI_FLOAT, block, blockSize, MPI_FLOAT, 0, level->comm);
+		for (i = 0; i < n; i++)
+			for (col = 0; col < n; col++)
+				level->halo->grid[(i + 1) * stride + col + 1] += block[i * n + col];
+	}
+	else if (rank == 0)
+		memset(serial->halo->grid, 0, (size_t)(serial->n + 2) * serial->halo->stride * sizeof(float));
+
+	free(block);
+	free(all);
+}
+
+//
+// Performs one V-cycle from level l down, improving the solution on that level in place.
+//
+void mgCycle(Multigrid *mg, int l)
+{
+	int i;
+	MultigridLevel *level = &mg->levels[l];
+
+	// Solve the same problem on rank 0 alone.
+	if (level->gather)
+	{
+		mgExchange(level);
+		mgResidual(level);
+		mgGatherScatter(level, 0);
+		if (l + 1 < mg->numLevels)
+			mgCycle(mg, l + 1);
+		mgGatherScatter(level, 1);
+		return;
+	}
+
+	// The coarsest level, which is small and only on one rank, is solved directly by SOR with the optimal
+	// relaxation factor. (One sweep is exact for a single cell.)
+	if (l == mg->numLevels - 1)
+	{
+		int sweeps = (level->n == 1 ? 1 : 2 * level->n);
+		float omega = 2.0 / (1.0 + sin(M_PI / (level->n + 1)));
+		for (i = 0; i < sweeps; i++)
+			mgSweep(level, omega);
+		return;
+	}
+
+	MultigridLevel *coarse = level + 1;
+
+	for (i = 0; i < MG_SMOOTHING; i++)
+		mgSweep(level, 1.0f);
+
+	mgExchange(level);
+	mgResidual(level);
+	mgRestrict(level, coarse);
+
+	mgCycle(mg, l + 1);
+
+	mgExchange(coarse);
+	mgProlong(level, coarse);
+
+	for (i = 0; i < MG_SMOOTHING; i++)
+		mgSweep(level, 1.0f);
+}
+
+//
+// Frees everything but the finest level's exchange and grid.
+//
+void mgFree(Multigrid *mg)
+{
+	int l, i;
+	for (l = mg->numLevels - 1; l >= 0; l--)
+	{
+		MultigridLevel *level = &mg->levels[l];
+		for (i = 0; i < 2; i++)
+			haloFree(&level->colourHalo[i]);
+		if (l > 0)
+			haloFree(&level->ownHalo);
+		free(level->f);
+		free(level->r);
+	}
+
+	if (mg->serialComm != MPI_COMM_NULL)
+		MPI_Comm_free(&mg->serialComm);
+}
@@ -0,0 +1,297 @@
+//
+// Per-process profiling of the phases of each iteration of heatEqn.c, to tell whether time is lost to
+// latency, bandwidth or load imbalance. Uses the exchange timers in heatEqn_halo.h, which must be included first.
+//
+// Usage:
+//
+// profileCreate   ( &prof, enabled, tracing );			// Once. Does nothing unless enabled.
+// profileStart    ( &prof );							// Just before the iterations.
+// profileMark     ( &prof, phase );					// After each phase of an iteration.
+// profileIteration( &prof, iteration );				// At the end of each iteration.
+// profileReport   ( &prof, comm, name, format, label );	// Once; rank 0 writes the summary to 'name'.
+// profileTrace    ( &prof, comm, prefix );				// Once, if tracing; writes <prefix>_<rank>.csv.
+// profileFree     ( &prof );							// Once.
+//
+// profileMark() charges the time since the previous mark to the given phase, except that any time spent
+// in haloStart() and haloFinish() in between is charged to the post and wait phases instead. So a solver
+// that exchanges ghost cells internally (SOR, multigrid or conjugate gradients) only needs one mark for its
+// computation, and the halo exchange is still separated out. The global sums inside conjugate gradients
+// count as computation.
+//
+// The summary gives the total time in each phase on every rank, and its minimum, maximum and mean across the
+// ranks. The wait phase is the time each rank spent waiting for its ghost cells; a large spread in the compute
+// phases (with the fastest ranks waiting longest) points to imbalance, while long waits everywhere point to
+// latency, or (if they grow with the local grid size) bandwidth.
+//
+
+// The phases of an iteration.
+typedef enum
+{
+	PROFILE_POST,	  // Starting the halo exchange, including any packing.
+	PROFILE_WAIT,	  // Waiting for the halo exchange to complete.
+	PROFILE_INTERIOR, // Updating the cells that do not depend on the ghost cells (or all cells, for other solvers).
+	PROFILE_EDGE,	  // Updating the cells that do.
+	PROFILE_REDUCE,	  // The global reduction for the convergence test.
+	PROFILE_IO,		  // Writing checkpoints and snapshots.
+	PROFILE_REBALANCE, // Moving cells between processes to balance the load.
+	PROFILE_NUM_PHASES
+} ProfilePhase;
+
+const char *profilePhaseNames[PROFILE_NUM_PHASES] = {"post", "wait", "interior", "edge", "reduce", "io", "rebalance"};
+
+// The available summary formats.
+typedef enum
+{
+	PROFILE_JSON,
+	PROFILE_CSV,
+	PROFILE_NUM_FORMATS
+} ProfileFormat;
+
+const char *profileFormatNames[PROFILE_NUM_FORMATS] = {"json", "csv"};
+
+#define PROFILE_COLUMNS (PROFILE_NUM_PHASES + 1) // The phases, then their total.
+
+typedef struct
+{
+	int enabled, tracing;
+	double totals[PROFILE_NUM_PHASES];	// The time in each phase over all iterations so far.
+	double current[PROFILE_NUM_PHASES]; // The time in each phase in this iteration.
+	double last;						// The time of the previous mark.
+	double haloPost, haloWait;			// haloPostTime and haloWaitTime at the previous mark.
+	long iterations;					// The number of calls to profileIteration().
+	double *trace;						// Tracing only: the iteration, then the time in each phase, for each iteration.
+	long traceCapacity;					// The number of iterations there is room for in trace.
+} Profile;
+
+//
+// Returns the format with the given name, or -1 if there is no such format.
+//
+int profileFormatFromName(const char *name)
+{
+	int format;
+	for (format = 0; format < PROFILE_NUM_FORMATS; format++)
+		if (!strcmp(name, profileFormatNames[format]))
+			return format;
+
+	return -1;
+}
+
+//
+// Prepares to profile, if enabled, and to keep the times of every iteration, if tracing.
+//
+void profileCreate(Profile *prof, int enabled, int tracing)
+{
+	memset(prof, 0, sizeof(Profile));
+	prof->enabled = enabled || tracing;
+	prof->tracing = tracing;
+}
+
+//
+// Starts timing the first phase.
+//
+void profileStart(Profile *prof)
+{
+	if (!prof->enabled)
+		return;
+
+	prof->last = MPI_Wtime();
+	prof->haloPost = haloPostTime;
+	prof->haloWait = haloWaitTime;
+}
+
+//
+// Charges the time since the previous mark to 'phase', apart from any time spent in the halo exchange.
+//
+void profileMark(Profile *prof, ProfilePhase phase)
+{
+	if (!prof->enabled)
+		return;
+
+	double now = MPI_Wtime(), post = haloPostTime - prof->haloPost, wait = haloWaitTime - prof->haloWait;
+	prof->current[PROFILE_POST] += post;
+	prof->current[PROFILE_WAIT] += wait;
+	prof->current[phase] += now - prof->last - post - wait;
+
+	prof->last = now;
+	prof->haloPost = haloPostTime;
+	prof->haloWait = haloWaitTime;
+}
+
+//
+// Ends an iteration, which leaves the grid after 'iteration' iterations.
+//
+void profileIteration(Profile *prof, int iteration)
+{
+	int phase;
+
+	if (!prof->enabled)
+		return;
+
+	if (prof->tracing)
+	{
+		// Doubling the capacity keeps the cost of growing it small.
+		if (prof->iterations == prof->traceCapacity)
+		{
+			prof->traceCapacity = (prof->traceCapacity ? 2 * prof->traceCapacity : 1024);
+			prof->trace = (double *)realloc(prof->trace, prof->traceCapacity * PROFILE_COLUMNS * sizeof(double));
+		}
+		double *row = &prof->trace[prof->iterations * PROFILE_COLUMNS];
+		row[0] = iteration;
+		memcpy(&row[1], prof->current, PROFILE_NUM_PHASES * sizeof(double));
+	}
+
+	for (phase = 0; phase < PROFILE_NUM_PHASES; phase++)
+	{
+		prof->totals[phase] += prof->current[phase];
+		prof->current[phase] = 0.0;
+	}
+	prof->iterations++;
+}
+
+//
+// Writes one row of times (the phases then the total) to a summary, in the given format.
+//
+void profileWriteRow(FILE *file, ProfileFormat format, const double *times)
+{
+	int column;
+
+	for (column = 0; column < PROFILE_COLUMNS; column++)
+		if (format == PROFILE_JSON)
+			fprintf(file, "%s\"%s\": %g", (column ? ", " : ""), (column < PROFILE_NUM_PHASES ? profilePhaseNames[column] : "total"), times[column]);
+		else
+			fprintf(file, ",%g", times[column]);
+}
+
+//
+// Gathers the times of every rank of comm onto rank 0, which writes them, and their minimum, maximum and
+// mean, to the file 'name' in the given format. 'label' describes the run (in JSON only). Collective.
+//
+void profileReport(Profile *prof, MPI_Comm comm, const char *name, ProfileFormat format, const char *label)
+{
+	int rank, numProcs, source, column, stat;
+	double local[PROFILE_COLUMNS] = {0.0};
+
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &numProcs);
+
+	// Including any time marked since the last iteration.
+	for (column = 0; column < PROFILE_NUM_PHASES; column++)
+	{
+		local[column] = prof->totals[column] + prof->current[column];
+		local[PROFILE_NUM_PHASES] += local[column];
+	}
+
+	double *all = NULL;
+	if (rank == 0)
+		all = (double *)malloc((size_t)numProcs * PROFILE_COLUMNS * sizeof(double));
+	MPI_Gather(local, PROFILE_COLUMNS, MPI_DOUBLE, all, PROFILE_COLUMNS, MPI_DOUBLE, 0, comm);
+	if (rank != 0)
+		return;
+
+	// Statistics across the ranks: the minimum, maximum and mean.
+	double stats[3][PROFILE_COLUMNS];
+	const char *statNames[3] = {"min", "max", "mean"};
+	for (column = 0; column < PROFILE_COLUMNS; column++)
+	{
+		stats[0][column] = stats[1][column] = all[column];
+		stats[2][column] = 0.0;
+		for (source = 0; source < numProcs; source++)
+		{
+			double t = all[source * PROFILE_COLUMNS + column];
+			stats[0][column] = (t < stats[0][column] ? t : stats[0][column]);
+			stats[1][column] = (t > stats[1][column] ? t : stats[1][column]);
+			stats[2][column] += t / numProcs;
+		}
+	}
+
+	FILE *file = fopen(name, "w");
+	if (!file)
+	{
+		printf("Could not open the profile file '%s'.\n", name);
+		free(all);
+		return;
+	}
+
+	if (format == PROFILE_JSON)
+	{
+		fprintf(file, "{\n  \"run\": \"%s\",\n  \"ranks\": %d,\n  \"iterations\": %ld,\n  \"exchanges\": %ld,\n", label, numProcs, prof->iterations, haloExchanges);
+		for (stat = 0; stat < 3; stat++)
+		{
+			fprintf(file, "  \"%s\": {", statNames[stat]);
+			profileWriteRow(file, format, stats[stat]);
+			fprintf(file, "},\n");
+		}
+		fprintf(file, "  \"perRank\": [\n");
+		for (source = 0; source < numProcs; source++)
+		{
+			fprintf(file, "    {\"rank\": %d, ", source);
+			profileWriteRow(file, format, &all[source * PROFILE_COLUMNS]);
+			fprintf(file, "}%s\n", (source < numProcs - 1 ? "," : ""));
+		}
+		fprintf(file, "  ]\n}\n");
+	}
+	else
+	{
+		fprintf(file, "rank");
+		for (column = 0; column < PROFILE_NUM_PHASES; column++)
+			fprintf(file, ",%s", profilePhaseNames[column]);
+		fprintf(file, ",total\n");
+		for (source = 0; source < numProcs; source++)
+		{
+			fprintf(file, "%d", source);
+			profileWriteRow(file, format, &all[source * PROFILE_COLUMNS]);
+			fprintf(file, "\n");
+		}
+		for (stat = 0; stat < 3; stat++)
+		{
+			fprintf(file, "%s", statNames[stat]);
+			profileWriteRow(file, format, stats[stat]);
+			fprintf(file, "\n");
+		}
+	}
+
+	fclose(file);
+	free(all);
+}
+
+//
+// Writes the times of every iteration on this rank of comm to <prefix>_<rank>.csv.
+//
+void profileTrace(Profile *prof, MPI_Comm comm, const char *prefix)
+{
+	int rank, phase;
+	long i;
+	char name[FILENAME_MAX];
+
+	MPI_Comm_rank(comm, &rank);
+	snprintf(name, sizeof(name), "%s_%d.csv", prefix, rank);
+	FILE *file = fopen(name, "w");
+	if (!file)
+	{
+		printf("Could not open the trace file '%s' on rank %d.\n", name, rank);
+		return;
+	}
+
+	fprintf(file, "iteration");
+	for (phase = 0; phase < PROFILE_NUM_PHASES; phase++)
+		fprintf(file, ",%s", profilePhaseNames[phase]);
+	fprintf(file, "\n");
+	for (i = 0; i < prof->iterations; i++)
+	{
+		const double *row = &prof->trace[i * PROFILE_COLUMNS];
+		fprintf(file, "%d", (int)row[0]);
+		for (phase = 0; phase < PROFILE_NUM_PHASES; phase++)
+			fprintf(file, ",%g", row[1 + phase]);
+		fprintf(file, "\n");
+	}
+
+	fclose(file);
+}
+
+//
+// Frees everything.
+//
+void profileFree(Profile *prof)
+{
+	free(prof->trace);
+}
@@ -0,0 +1,127 @@
+//
+// Reaction-diffusion of coupled fields for heatEqn.c, starting with the Gray-Scott model of two species u and v:
+//
+// du/dt = Du lap(u) - u v^2 + F (1 - u),   dv/dt = Dv lap(v) + u v^2 - (F + k) v,
+//
+// stepped explicitly (forward Euler), with the same 5-point Laplacian as the heat equation. v feeds on u, which
+// is replenished at the feed rate F, and v is removed at the rate F + k; from a small seed, this grows spots,
+// stripes or waves, depending on F and k. Uses haloCreateFields() from heatEqn_halo.h, which must be included first.
+//
+// Usage:
+//
+// reactionCreate    ( &rd, du, dv, feed, kill, dt, dx );					// Once.
+// reactionInitialise( grid, comm, rows, cols, ghost, stride, L );			// Once per grid, before the steps.
+// change = reactionRow( dest, src, &rd, stride, n );						// As stencilRow(); each step.
+// reactionField     ( dest, grid, rows, cols, ghost, stride, field );		// To display or write one field.
+//
+// The fields are interleaved: each cell holds u then v (REACTION_FIELDS floats), in a grid created with
+// haloCreateFields(), so the ghost cells of both travel in one message per direction. The coupled steps are
+// usually latency-bound, so exchanging the fields separately would nearly double the time spent exchanging.
+// Interleaving also keeps the reaction term, which needs both fields of a cell, to one stream through memory.
+// Cell (row,col) of the local grid, counting the ghost cells from 0, starts at row*stride + REACTION_FIELDS*col.
+//
+// The boundary is held at the uniform state u = 1, v = 0, and the seed (u = 1/2, v = 1/4) fills the same square
+// in the middle of the domain as the heater of heatEqn_diffusion.h, with a small perturbation of each cell that
+// depends only on its global position, so the results do not depend on the number of processes.
+//
+
+#define REACTION_FIELDS 2 // The number of interleaved fields per cell: u, then v.
+
+typedef struct
+{
+	float du, dv;	 // Du dt / dx^2 and Dv dt / dx^2.
+	float feed, kill; // F and k, times dt.
+} Reaction;
+
+//
+// Works out the coefficients for diffusivities du and dv, feed rate F, kill rate k, time step dt and grid spacing
+// dx. Forward Euler is only stable for dt <= dx^2 / (4 max(du,dv)).
+//
+void reactionCreate(Reaction *rd, double du, double dv, double feed, double kill, double dt, double dx)
+{
+	rd->du = du * dt / (dx * dx);
+	rd->dv = dv * dt / (dx * dx);
+	rd->feed = feed * dt;
+	rd->kill = kill * dt;
+}
+
+//
+// Fills a local grid of rows*cols cells, with 'ghost' layers of ghost cells and rows 'stride' floats apart, with
+// the initial state. The blocks are all the same size, arranged as in the 2D Cartesian communicator comm, of a
+// grid L cells across (excluding the boundary).
+//
+void reactionInitialise(float *grid, MPI_Comm comm, int rows, int cols, int ghost, size_t stride, int L)
+{
+	int row, dims[2], periods[2], coords[2];
+
+	MPI_Cart_get(comm, 2, dims, periods, coords);
+
+	// As for the other grids, the first touch uses the same static schedule as the steps.
+#pragma omp parallel for schedule(static)
+	for (row = 0; row < rows + 2 * ghost; row++)
+	{
+		int col, globalRow = coords[0] * rows + row - ghost + 1;
+		for (col = 0; col < cols + 2 * ghost; col++)
+		{
+			int globalCol = coords[1] * cols + col - ghost + 1;
+			float *cell = &grid[row * stride + REACTION_FIELDS * col];
+			double x = (double)globalCol / (L + 1), y = (double)globalRow / (L + 1);
+
+			cell[0] = 1.0f;
+			cell[1] = 0.0f;
+			if (globalRow >= 1 && globalRow <= L && globalCol >= 1 && globalCol <= L && fabs(x - 0.5) < 0.1 && fabs(y - 0.5) < 0.1)
+			{
+				// A hash of the position gives up to 1% of noise, to break the symmetry.
+				unsigned int h = (unsigned int)globalRow * 73856093u ^ (unsigned int)globalCol * 19349663u;
+				h ^= h >> 13;
+				h *= 0x5bd1e995u;
+				h ^= h >> 15;
+				cell[0] = 0.5f + 0.01f * ((h & 0xffff) / 65535.0f - 0.5f);
+				cell[1] = 0.25f + 0.01f * ((h >> 16) / 65535.0f - 0.5f);
+			}
+		}
+	}
+}
+
+//
+// One forward Euler step of both fields along part of one row: updates n cells from dest[0], reading the same
+// cells of the old grid from src[0] (both interleaved, with rows 'stride' floats apart), and returns the largest
+// change to either field of any of them. As for the Jacobi stencil, the maximum is taken with a comparison.
+//
+static inline float reactionRow(float *restrict dest, const float *restrict src, const Reaction *rd, size_t stride, int n)
+{
+	int i;
+	float change = 0.0f, du = rd->du, dv = rd->dv, feed = rd->feed, kill = rd->kill;
+#pragma omp simd reduction(max : change)
+	for (i = 0; i < n; i++)
+	{
+		int j = REACTION_FIELDS * i;
+		float u = src[j], v = src[j + 1], uvv = u * v * v;
+		float lapU = src[j + stride] + src[j - stride] + src[j + REACTION_FIELDS] + src[j - REACTION_FIELDS] - 4.0f * u;
+		float lapV = src[j + 1 + stride] + src[j + 1 - stride] + src[j + 1 + REACTION_FIELDS] + src[j + 1 - REACTION_FIELDS] - 4.0f * v;
+		float newU = u + du * lapU - uvv + feed * (1.0f - u), newV = v + dv * lapV + uvv - (feed + kill) * v;
+		dest[j] = newU;
+		dest[j + 1] = newV;
+
+		float diffU = fabsf(newU - u), diffV = fabsf(newV - v), diff = (diffU > diffV ? diffU : diffV);
+		change = (diff > change ? diff : change);
+	}
+	return change;
+}
+
+//
+// Copies one field (0 for u, 1 for v) of an interleaved local grid (rows*cols cells with 'ghost' layers of ghost
+// cells, and rows 'stride' floats apart) into dest, a grid of single floats with the same stride, i.e. with
+// cell (row,col) at row*stride + col, as heatEqn.c lays out its other grids.
+//
+void reactionField(float *dest, const float *grid, int rows, int cols, int ghost, size_t stride, int field)
+{
+	int row;
+#pragma omp parallel for schedule(static)
+	for (row = 0; row < rows + 2 * ghost; row++)
+	{
+		int col;
+		for (col = 0; col < cols + 2 * ghost; col++)
+			dest[row * stride + col] = grid[row * stride + REACTION_FIELDS * col + field];
+	}
+}
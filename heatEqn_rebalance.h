@@ -0,0 +1,214 @@
+//
+// Measurement-driven load balancing for the Jacobi solver of heatEqn.c, for processes that do not all
+// compute at the same speed (e.g. on nodes of different generations).
+//
+// Usage:
+//
+// rebalanceCreate   ( &rb, comm, L, minSize );				// Once; starts with the even split.
+// rb.time += ...;											// The time spent computing since the last rebalance.
+// if (rebalancePartition( &rb, rowStarts, colStarts ))		// Every M iterations; non-zero if worth moving to.
+//     rebalanceMigrate( &rb, oldGrid, ..., newGrid, ..., rowStarts, colStarts );
+// rebalanceFree     ( &rb );								// Once.
+//
+// The p*p blocks stay in a grid of block rows and block columns, i.e. all the blocks in a block row are the
+// same height, and all those in a block column the same width, so each block still has a single neighbour
+// on each side (and the ghost-cell exchange is unchanged, apart from the sizes). Block row i covers rows
+// rowStarts[i] to rowStarts[i+1]-1 of the global grid (from 0, excluding the boundary), and similarly columns.
+//
+// Each process's speed is measured in cells updated per second of computation (excluding the halo exchange).
+// Each block row is then given a height in proportion to the rate (in rows per second) at which the slowest
+// process in it can update rows of its current width, and then each block column a width in proportion to
+// the rate at which the slowest process in it can update columns of its new height. The new partition is
+// only used if it is predicted to reduce the time of the slowest process by at least REBALANCE_THRESHOLD, so
+// that noise in the measurements does not move cells back and forth.
+//
+// Moving the boundaries migrates strips of cells between the blocks either side of them, which is done by
+// a single MPI_Alltoallw() with subarray datatypes in which only the blocks that overlap exchange anything.
+//
+
+#define REBALANCE_THRESHOLD 0.05 // The smallest fractional reduction in the predicted time worth moving cells for.
+
+typedef struct
+{
+	MPI_Comm comm;				// 2D Cartesian communicator over the blocks, in row-major order.
+	int p;						// The number of blocks in each direction.
+	int L;						// The global grid size, excluding the boundary.
+	int minSize;				// The smallest height or width of a block.
+	int coords[2];				// This block's block row and column.
+	int *rowStarts, *colStarts; // The first row of each block row, and the first column of each block column; p+1 each.
+	double time;				// The time this process has spent computing since the last rebalance.
+} Rebalance;
+
+//
+// Starts with each block L/p square. 'comm' is the p*p Cartesian communicator over the blocks.
+//
+void rebalanceCreate(Rebalance *rb, MPI_Comm comm, int L, int minSize)
+{
+	int i, dims[2], periods[2];
+
+	MPI_Cart_get(comm, 2, dims, periods, rb->coords);
+	rb->comm = comm;
+	rb->p = dims[0];
+	rb->L = L;
+	rb->minSize = minSize;
+	rb->time = 0.0;
+
+	rb->rowStarts = (int *)malloc(2 * (rb->p + 1) * sizeof(int));
+	rb->colStarts = rb->rowStarts + rb->p + 1;
+	for (i = 0; i <= rb->p; i++)
+		rb->rowStarts[i] = rb->colStarts[i] = i * (L / rb->p);
+}
+
+//
+// Sets the p+1 boundaries 'starts' so that the sizes between them are in proportion to 'weights' (as nearly
+// as whole numbers allow), but no smaller than minSize.
+//
+void rebalanceBoundaries(const Rebalance *rb, const double *weights, int *starts)
+{
+	int i;
+	double total = 0.0, sum = 0.0;
+
+	for (i = 0; i < rb->p; i++)
+		total += weights[i];
+
+	starts[0] = 0;
+	for (i = 1; i < rb->p; i++)
+	{
+		sum += weights[i - 1];
+		starts[i] = (int)(rb->L * sum / total + 0.5);
+
+		// Leave at least minSize for this block, and for each of the rest.
+		if (starts[i] < starts[i - 1] + rb->minSize)
+			starts[i] = starts[i - 1] + rb->minSize;
+		if (starts[i] > rb->L - (rb->p - i) * rb->minSize)
+			starts[i] = rb->L - (rb->p - i) * rb->minSize;
+	}
+	starts[rb->p] = rb->L;
+}
+
+//
+// The time the slowest process would take to update its block of the given partition, at the given speeds.
+//
+double rebalancePredict(const Rebalance *rb, const double *speeds, const int *rowStarts, const int *colStarts)
+{
+	int i, j;
+	double slowest = 0.0;
+
+	for (i = 0; i < rb->p; i++)
+		for (j = 0; j < rb->p; j++)
+		{
+			double t = (double)(rowStarts[i + 1] - rowStarts[i]) * (colStarts[j + 1] - colStarts[j]) / speeds[i * rb->p + j];
+			slowest = (t > slowest ? t : slowest);
+		}
+
+	return slowest;
+}
+
+//
+// Works out a better partition from the time each process has spent computing since the last call, into
+// rowStarts and colStarts (p+1 each). Returns non-zero if it is worth moving to. Collective; every process
+// arrives at the same answer, from the same measurements.
+//
+int rebalancePartition(Rebalance *rb, int *rowStarts, int *colStarts)
+{
+	int i, j, p = rb->p;
+	double cells = (double)(rb->rowStarts[rb->coords[0] + 1] - rb->rowStarts[rb->coords[0]]) * (rb->colStarts[rb->coords[1] + 1] - rb->colStarts[rb->coords[1]]);
+	double speed = cells / (rb->time > 0.0 ? rb->time : 1e-9);
+
+	double *speeds = (double *)malloc((p * p + p) * sizeof(double)), *weights = speeds + p * p;
+	MPI_Allgather(&speed, 1, MPI_DOUBLE, speeds, 1, MPI_DOUBLE, rb->comm);
+	rb->time = 0.0;
+
+	// Rows per second that each block row can manage at its current widths, set by its slowest process ...
+	for (i = 0; i < p; i++)
+		for (weights[i] = HUGE_VAL, j = 0; j < p; j++)
+		{
+			double rate = speeds[i * p + j] / (rb->colStarts[j + 1] - rb->colStarts[j]);
+			weights[i] = (rate < weights[i] ? rate : weights[i]);
+		}
+	rebalanceBoundaries(rb, weights, rowStarts);
+
+	// ... then columns per second for each block column, at the new heights.
+	for (j = 0; j < p; j++)
+		for (weights[j] = HUGE_VAL, i = 0; i < p; i++)
+		{
+			double rate = speeds[i * p + j] / (rowStarts[i + 1] - rowStarts[i]);
+			weights[j] = (rate < weights[j] ? rate : weights[j]);
+		}
+	rebalanceBoundaries(rb, weights, colStarts);
+
+	double before = rebalancePredict(rb, speeds, rb->rowStarts, rb->colStarts), after = rebalancePredict(rb, speeds, rowStarts, colStarts);
+	free(speeds);
+	return (after < (1.0 - REBALANCE_THRESHOLD) * before);
+}
+
+//
+// Creates a subarray datatype for the cells of the global rows [r0,r1) and columns [c0,c1) in the local grid
+// of the block starting at global (row0,col0), with 'ghost' layers of ghost cells, 'rows' rows and rows
+// 'stride' floats apart. Returns 0 (and no datatype) if there are no such cells.
+//
+int rebalanceOverlap(int r0, int r1, int c0, int c1, int row0, int col0, int rows, int ghost, int stride, MPI_Datatype *type)
+{
+	if (r1 <= r0 || c1 <= c0)
+		return 0;
+
+	int sizes[2] = {rows + 2 * ghost, stride}, subSizes[2] = {r1 - r0, c1 - c0}, starts[2] = {ghost + r0 - row0, ghost + c0 - col0};
+	MPI_Type_create_subarray(2, sizes, subSizes, starts, MPI_ORDER_C, MPI_FLOAT, type);
+	MPI_Type_commit(type);
+	return 1;
+}
+
+//
+// Moves to the partition given by rowStarts and colStarts, copying the cells of this process's block (not
+// the ghost cells) from oldGrid, laid out for the current partition with rows oldStride floats apart, to the
+// processes that now own them, and filling in the cells of its new block in newGrid, with rows newStride
+// floats apart. Both have 'ghost' layers of ghost cells. Collective.
+//
+void rebalanceMigrate(Rebalance *rb, const float *oldGrid, int oldStride, float *newGrid, int newStride, int ghost, const int *rowStarts, const int *colStarts)
+{
+	int q, numProcs = rb->p * rb->p, i = rb->coords[0], j = rb->coords[1];
+	int oldR0 = rb->rowStarts[i], oldR1 = rb->rowStarts[i + 1], oldC0 = rb->colStarts[j], oldC1 = rb->colStarts[j + 1];
+	int newR0 = rowStarts[i], newR1 = rowStarts[i + 1], newC0 = colStarts[j], newC1 = colStarts[j + 1];
+
+	int *counts = (int *)calloc(4 * numProcs, sizeof(int)), *recvCounts = counts + numProcs, *displs = counts + 2 * numProcs;
+	MPI_Datatype *types = (MPI_Datatype *)calloc(2 * numProcs, sizeof(MPI_Datatype)), *recvTypes = types + numProcs;
+
+	// What each process q (block row qi, column qj) needs from our old block, and has for our new one. Unless
+	// the speeds have changed a lot, this is nothing for all but the neighbouring blocks.
+	for (q = 0; q < numProcs; q++)
+	{
+		int qi = q / rb->p, qj = q % rb->p;
+		int sendR0 = (oldR0 > rowStarts[qi] ? oldR0 : rowStarts[qi]), sendR1 = (oldR1 < rowStarts[qi + 1] ? oldR1 : rowStarts[qi + 1]);
+		int sendC0 = (oldC0 > colStarts[qj] ? oldC0 : colStarts[qj]), sendC1 = (oldC1 < colStarts[qj + 1] ? oldC1 : colStarts[qj + 1]);
+		int recvR0 = (newR0 > rb->rowStarts[qi] ? newR0 : rb->rowStarts[qi]), recvR1 = (newR1 < rb->rowStarts[qi + 1] ? newR1 : rb->rowStarts[qi + 1]);
+		int recvC0 = (newC0 > rb->colStarts[qj] ? newC0 : rb->colStarts[qj]), recvC1 = (newC1 < rb->colStarts[qj + 1] ? newC1 : rb->colStarts[qj + 1]);
+
+		types[q] = recvTypes[q] = MPI_FLOAT;
+		counts[q] = rebalanceOverlap(sendR0, sendR1, sendC0, sendC1, oldR0, oldC0, oldR1 - oldR0, ghost, oldStride, &types[q]);
+		recvCounts[q] = rebalanceOverlap(recvR0, recvR1, recvC0, recvC1, newR0, newC0, newR1 - newR0, ghost, newStride, &recvTypes[q]);
+	}
+
+	// The datatypes give the offsets, so the displacements are all zero.
+	MPI_Alltoallw(oldGrid, counts, displs, types, newGrid, recvCounts, displs, recvTypes, rb->comm);
+
+	for (q = 0; q < numProcs; q++)
+	{
+		if (counts[q])
+			MPI_Type_free(&types[q]);
+		if (recvCounts[q])
+			MPI_Type_free(&recvTypes[q]);
+	}
+	free(counts);
+	free(types);
+
+	memcpy(rb->rowStarts, rowStarts, (rb->p + 1) * sizeof(int));
+	memcpy(rb->colStarts, colStarts, (rb->p + 1) * sizeof(int));
+}
+
+//
+// Frees everything.
+//
+void rebalanceFree(Rebalance *rb)
+{
+	free(rb->rowStarts);
+}
@@ -0,0 +1,378 @@
+//
+// Gathering the distributed grid of heatEqn.c onto rank 0 in a single collective, for display and for
+// snapshots written as images or raw binary files.
+//
+// Usage:
+//
+// snapshotCreate( &snap, comm, rows, cols, ghost, stride );		// Once.
+// snapshotGather( &snap, grid );								// The whole grid is then in snap.image on rank 0.
+// snapshotWrite ( &snap, grid, prefix, format, iteration );		// Gathers, then writes <prefix>_<iteration>.<format>.
+// snapshotFree  ( &snap );										// Once.
+//
+// Every rank sends its block straight from its grid (excluding the ghost cells and padding) with one
+// MPI_Gatherv(), which places each block in the image on rank 0 with a subarray datatype, so there is no
+// packing or unpacking by hand. The image, which excludes the boundary, has to fit in rank 0's memory.
+//
+// Alternatively, snapshots can be written by dedicated I/O ranks ('servers'), so that the ranks computing
+// the grid ('clients') only have to copy their blocks and start sending them before carrying on:
+//
+// snapshotServe       ( comm, ioComm, p, l, prefix, format );				// On each server, until told to stop.
+// snapshotClientCreate( &client, comm, server, rows, cols );				// Once, on each client.
+// snapshotClientSend  ( &client, grid, ghost, stride, iteration );		// For each snapshot.
+// snapshotClientFree  ( &client );											// Once; also tells the server to stop.
+//
+// Each server collects whole rows of blocks, so it holds a contiguous stripe of the image, and the servers
+// write their stripes to each file together with MPI-IO. A client waits for its previous snapshot to have
+// been sent before copying the next, so servers that fall behind eventually slow the clients down.
+//
+
+#define SNAPSHOT_TAG_ITERATION 1 // Client to server: the iteration of the block that follows, or -1 to stop.
+#define SNAPSHOT_TAG_BLOCK 2	 // Client to server: the block itself.
+
+// The available file formats.
+typedef enum
+{
+	SNAPSHOT_RAW, // Native floats, row by row.
+	SNAPSHOT_PGM, // 8-bit greyscale image, scaled from the smallest to the largest value.
+	SNAPSHOT_PPM, // 8-bit false-colour image (black, red, yellow, white), scaled likewise.
+	SNAPSHOT_NUM_FORMATS
+} SnapshotFormat;
+
+const char *snapshotFormatNames[SNAPSHOT_NUM_FORMATS] = {"raw", "pgm", "ppm"};
+
+typedef struct
+{
+	MPI_Comm comm;			// 2D Cartesian communicator over the blocks.
+	int globalSizes[2];		// Size of the whole grid.
+	int rows, cols;			// Size of the local block.
+	MPI_Datatype gridType;	// The block's cells in the local grid.
+	MPI_Datatype blockType; // Rank 0 only: a block's cells in the image, with the extent of one block row.
+	int *counts, *displs;	// Rank 0 only: where each block goes in the image, in units of blockType's extent.
+	float *image;			// Rank 0 only: the whole grid.
+} Snapshot;
+
+//
+// Returns the format with the given name, or -1 if there is no such format.
+//
+int snapshotFormatFromName(const char *name)
+{
+	int format;
+	for (format = 0; format < SNAPSHOT_NUM_FORMATS; format++)
+		if (!strcmp(name, snapshotFormatNames[format]))
+			return format;
+
+	return -1;
+}
+
+//
+// Prepares to gather a grid of equal rows*cols blocks, each with 'ghost' layers of ghost cells and rows
+// 'stride' floats apart, arranged as in the 2D Cartesian communicator comm (whose ranks are in row-major order).
+//
+void snapshotCreate(Snapshot *snap, MPI_Comm comm, int rows, int cols, int ghost, int stride)
+{
+	int rank, numProcs, source, dims[2], periods[2], coords[2];
+
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &numProcs);
+	MPI_Cart_get(comm, 2, dims, periods, coords);
+
+	snap->comm = comm;
+	snap->rows = rows;
+	snap->cols = cols;
+	snap->globalSizes[0] = dims[0] * rows;
+	snap->globalSizes[1] = dims[1] * cols;
+	snap->counts = snap->displs = NULL;
+	snap->image = NULL;
+
+	int sizes[2] = {rows, cols}, gridSizes[2] = {rows + 2 * ghost, stride}, gridStarts[2] = {ghost, ghost};
+	MPI_Type_create_subarray(2, gridSizes, sizes, gridStarts, MPI_ORDER_C, MPI_FLOAT, &snap->gridType);
+	MPI_Type_commit(&snap->gridType);
+
+	if (rank != 0)
+		return;
+
+	// A block at the start of the image, resized so that displacements count in blocks across a row. Block
+	// (r,c) then starts r*rows*globalCols + c*cols floats in, i.e. r*dims[1]*rows + c extents.
+	MPI_Datatype block;
+	int starts[2] = {0, 0};
+	MPI_Type_create_subarray(2, snap->globalSizes, sizes, starts, MPI_ORDER_C, MPI_FLOAT, &block);
+	MPI_Type_create_resized(block, 0, cols * sizeof(float), &snap->blockType);
+	MPI_Type_commit(&snap->blockType);
+	MPI_Type_free(&block);
+
+	snap->counts = (int *)malloc(numProcs * sizeof(int));
+	snap->displs = (int *)malloc(numProcs * sizeof(int));
+	for (source = 0; source < numProcs; source++)
+	{
+		MPI_Cart_coords(comm, source, 2, coords);
+		snap->counts[source] = 1;
+		snap->displs[source] = coords[0] * dims[1] * rows + coords[1];
+	}
+
+	size_t imageBytes = (size_t)snap->globalSizes[0] * snap->globalSizes[1] * sizeof(float);
+	if (!(snap->image = (float *)malloc(imageBytes)))
+		haloAllocateFail(comm, imageBytes);
+}
+
+//
+// Gathers the whole grid into snap->image on rank 0. Collective over the communicator.
+//
+void snapshotGather(Snapshot *snap, const float *grid)
+{
+	MPI_Gatherv(grid, 1, snap->gridType, snap->image, snap->counts, snap->displs, snap->blockType, 0, snap->comm);
+}
+
+//
+// The number of bytes per cell in a file of the given format.
+//
+int snapshotCellBytes(SnapshotFormat format)
+{
+	return (format == SNAPSHOT_RAW ? sizeof(float) : (format == SNAPSHOT_PPM ? 3 : 1));
+}
+
+//
+// Finds the smallest and largest of n values.
+//
+void snapshotRange(const float *values, size_t n, float *lo, float *hi)
+{
+	size_t i;
+
+	*lo = *hi = (n ? values[0] : 0.0f);
+	for (i = 1; i < n; i++)
+	{
+		*lo = (values[i] < *lo ? values[i] : *lo);
+		*hi = (values[i] > *hi ? values[i] : *hi);
+	}
+}
+
+//
+// Formats the header of a file for a snapshot of the given size, whose values range from lo to hi, into
+// 'header' (with room for SNAPSHOT_HEADER_MAX characters). Returns its length, which is zero for raw files.
+//
+#define SNAPSHOT_HEADER_MAX 256
+
+int snapshotHeader(char *header, SnapshotFormat format, int iteration, float lo, float hi, const int *sizes)
+{
+	if (format == SNAPSHOT_RAW)
+		return 0;
+
+	// The range is recorded in a comment, as the image is scaled over it.
+	return snprintf(header, SNAPSHOT_HEADER_MAX, "P%d\n# iteration %d, values from %g to %g\n%d %d\n255\n", (format == SNAPSHOT_PPM ? 6 : 5), iteration, lo, hi, sizes[1], sizes[0]);
+}
+
+//
+// Converts n values to the cells of a file of the given format, scaled from lo to hi for images. Returns the
+// values themselves for raw files, and otherwise an array that the caller must free.
+//
+void *snapshotEncode(const float *values, size_t n, SnapshotFormat format, float lo, float hi)
+{
+	size_t i;
+	int c;
+
+	if (format == SNAPSHOT_RAW)
+		return (void *)values;
+
+	float scale = (hi > lo ? 1.0f / (hi - lo) : 0.0f);
+	unsigned char *pixels = (unsigned char *)malloc(n * snapshotCellBytes(format));
+	for (i = 0; i < n; i++)
+	{
+		float t = (values[i] - lo) * scale;
+		if (format == SNAPSHOT_PGM)
+			pixels[i] = (unsigned char)(255.0f * t + 0.5f);
+		else
+			// Black to red to yellow to white, i.e. red, then green, then blue ramping up in turn.
+			for (c = 0; c < 3; c++)
+			{
+				float v = 3.0f * t - c;
+				pixels[3 * i + c] = (unsigned char)(255.0f * (v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v)) + 0.5f);
+			}
+	}
+
+	return pixels;
+}
+
+//
+// Gathers the grid after 'iteration' iterations, and writes it (from rank 0) to <prefix>_<iteration>.<format>.
+//
+void snapshotWrite(Snapshot *snap, const float *grid, const char *prefix, SnapshotFormat format, int iteration)
+{
+	int rank;
+	size_t numCells = (size_t)snap->globalSizes[0] * snap->globalSizes[1];
+
+	snapshotGather(snap, grid);
+
+	MPI_Comm_rank(snap->comm, &rank);
+	if (rank != 0)
+		return;
+
+	char name[FILENAME_MAX];
+	snprintf(name, sizeof(name), "%s_%06d.%s", prefix, iteration, snapshotFormatNames[format]);
+	FILE *file = fopen(name, "wb");
+	if (!file)
+	{
+		printf("Could not open the snapshot file '%s'.\n", name);
+		return;
+	}
+
+	float lo, hi;
+	char header[SNAPSHOT_HEADER_MAX];
+	snapshotRange(snap->image, numCells, &lo, &hi);
+	fwrite(header, 1, snapshotHeader(header, format, iteration, lo, hi, snap->globalSizes), file);
+	void *data = snapshotEncode(snap->image, numCells, format, lo, hi);
+	fwrite(data, 1, numCells * snapshotCellBytes(format), file);
+	if (data != snap->image)
+		free(data);
+
+	fclose(file);
+}
+
+//
+// Frees everything.
+//
+void snapshotFree(Snapshot *snap)
+{
+	int rank;
+
+	MPI_Comm_rank(snap->comm, &rank);
+	MPI_Type_free(&snap->gridType);
+	if (rank == 0)
+		MPI_Type_free(&snap->blockType);
+	free(snap->counts);
+	free(snap->displs);
+	free(snap->image);
+}
+
+//
+// Writes snapshots on an I/O rank, until all of its clients have told it to stop. The clients are the p*p
+// ranks 0 to p*p-1 of comm, each with an l*l block, arranged row-major, and the servers (the ranks of ioComm,
+// which are not clients) share the rows of blocks between them as evenly as possible, in order.
+//
+void snapshotServe(MPI_Comm comm, MPI_Comm ioComm, int p, int l, const char *prefix, SnapshotFormat format)
+{
+	int server, numServers, blockRow, col, iteration = 0;
+
+	MPI_Comm_rank(ioComm, &server);
+	MPI_Comm_size(ioComm, &numServers);
+
+	int firstBlockRow = (server * p + numServers - 1) / numServers, lastBlockRow = ((server + 1) * p + numServers - 1) / numServers;
+	int sizes[2] = {p * l, p * l}, stripeRows = (lastBlockRow - firstBlockRow) * l;
+	size_t stripeCells = (size_t)stripeRows * sizes[1];
+
+	float *stripe = (float *)malloc(stripeCells * sizeof(float));
+	if (!stripe)
+		haloAllocateFail(comm, stripeCells * sizeof(float));
+
+	// Each block goes into the stripe at its own row and column; the subarray is offset by the receive address.
+	MPI_Datatype blockType;
+	int blockSizes[2] = {l, l}, stripeSizes[2] = {stripeRows, sizes[1]}, starts[2] = {0, 0};
+	MPI_Type_create_subarray(2, stripeSizes, blockSizes, starts, MPI_ORDER_C, MPI_FLOAT, &blockType);
+	MPI_Type_commit(&blockType);
+
+	// The stripes are written a row at a time, as a stripe of a large grid may be more bytes than an int can count.
+	MPI_Datatype rowType;
+	MPI_Type_contiguous(sizes[1] * snapshotCellBytes(format), MPI_BYTE, &rowType);
+	MPI_Type_commit(&rowType);
+
+	while (iteration != -1)
+	{
+		// Every client sends every snapshot, so all the servers take part in the same ones.
+		for (blockRow = firstBlockRow; blockRow < lastBlockRow; blockRow++)
+			for (col = 0; col < p; col++)
+			{
+				MPI_Recv(&iteration, 1, MPI_INT, blockRow * p + col, SNAPSHOT_TAG_ITERATION, comm, MPI_STATUS_IGNORE);
+				if (iteration != -1)
+					MPI_Recv(&stripe[(size_t)(blockRow - firstBlockRow) * l * sizes[1] + col * l], 1, blockType, blockRow * p + col, SNAPSHOT_TAG_BLOCK, comm, MPI_STATUS_IGNORE);
+			}
+		if (iteration == -1)
+			break;
+
+		// The images are scaled over the range of the whole grid, i.e. of all the stripes.
+		float range[2], globalRange[2];
+		snapshotRange(stripe, stripeCells, &range[0], &range[1]);
+		range[0] = -range[0];
+		MPI_Allreduce(range, globalRange, 2, MPI_FLOAT, MPI_MAX, ioComm);
+
+		char header[SNAPSHOT_HEADER_MAX], name[FILENAME_MAX];
+		int headerBytes = snapshotHeader(header, format, iteration, -globalRange[0], globalRange[1], sizes), cellBytes = snapshotCellBytes(format);
+		void *data = snapshotEncode(stripe, stripeCells, format, -globalRange[0], globalRange[1]);
+
+		// Each stripe is contiguous in the file, after the header (which the first server writes).
+		MPI_File file;
+		snprintf(name, sizeof(name), "%s_%06d.%s", prefix, iteration, snapshotFormatNames[format]);
+		if (server == 0)
+			MPI_File_delete(name, MPI_INFO_NULL);
+		MPI_Barrier(ioComm);
+		if (MPI_File_open(ioComm, name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) == MPI_SUCCESS)
+		{
+			MPI_File_write_at_all(file, 0, header, (server == 0 ? headerBytes : 0), MPI_CHAR, MPI_STATUS_IGNORE);
+			MPI_File_write_at_all(file, headerBytes + (MPI_Offset)firstBlockRow * l * sizes[1] * cellBytes, data, stripeRows, rowType, MPI_STATUS_IGNORE);
+			MPI_File_close(&file);
+		}
+		else if (server == 0)
+			printf("Could not open the snapshot file '%s'.\n", name);
+
+		if (data != stripe)
+			free(data);
+	}
+
+	MPI_Type_free(&blockType);
+	MPI_Type_free(&rowType);
+	free(stripe);
+}
+
+//
+// The sending side of a client of an I/O rank.
+//
+typedef struct
+{
+	MPI_Comm comm;			 // The communicator shared with the servers.
+	int server;				 // The rank in comm of this client's server.
+	int rows, cols;			 // Size of the local block.
+	float *buffer;			 // A copy of the block being sent.
+	int iteration;			 // The iteration of the block being sent.
+	MPI_Request requests[2]; // The sends in progress, or MPI_REQUEST_NULL.
+} SnapshotClient;
+
+//
+// Prepares to send rows*cols blocks to the given server, which is rank 'server' of comm.
+//
+void snapshotClientCreate(SnapshotClient *client, MPI_Comm comm, int server, int rows, int cols)
+{
+	client->comm = comm;
+	client->server = server;
+	client->rows = rows;
+	client->cols = cols;
+	client->requests[0] = client->requests[1] = MPI_REQUEST_NULL;
+	if (!(client->buffer = (float *)malloc((size_t)rows * cols * sizeof(float))))
+		haloAllocateFail(comm, (MPI_Aint)rows * cols * sizeof(float));
+}
+
+//
+// Starts sending the block of a grid with 'ghost' layers of ghost cells and rows 'stride' floats apart,
+// after 'iteration' iterations, to the server. Returns as soon as the block has been copied.
+//
+void snapshotClientSend(SnapshotClient *client, const float *grid, int ghost, int stride, int iteration)
+{
+	int row;
+
+	MPI_Waitall(2, client->requests, MPI_STATUSES_IGNORE);
+
+	for (row = 0; row < client->rows; row++)
+		memcpy(&client->buffer[(size_t)row * client->cols], &grid[(size_t)(row + ghost) * stride + ghost], client->cols * sizeof(float));
+
+	client->iteration = iteration;
+	MPI_Isend(&client->iteration, 1, MPI_INT, client->server, SNAPSHOT_TAG_ITERATION, client->comm, &client->requests[0]);
+	MPI_Isend(client->buffer, client->rows * client->cols, MPI_FLOAT, client->server, SNAPSHOT_TAG_BLOCK, client->comm, &client->requests[1]);
+}
+
+//
+// Waits for the last block to be sent, then tells the server there are no more.
+//
+void snapshotClientFree(SnapshotClient *client)
+{
+	int stop = -1;
+
+	MPI_Waitall(2, client->requests, MPI_STATUSES_IGNORE);
+	MPI_Send(&stop, 1, MPI_INT, client->server, SNAPSHOT_TAG_ITERATION, client->comm);
+	free(client->buffer);
+}